@@ -0,0 +1,18 @@
+BENCHMARK_ARGS =
+
+benchmark: all
+	$(PHP_EXECUTABLE) -n -d extension_dir=$(top_builddir)/modules -d extension=tideways.$(SHLIB_DL_SUFFIX_NAME) -d tideways.auto_prepend_library=0 $(top_srcdir)/tests/benchmark.php $(BENCHMARK_ARGS)
+
+.PHONY: benchmark
+
+STRESS_ARGS =
+
+# thread safe builds only, needs PHP configured with --enable-embed
+$(top_builddir)/tests/zts/tideways-stress: $(top_srcdir)/tests/zts/stress.c
+	$(CC) $(CFLAGS) $(INCLUDES) -o $@ $(top_srcdir)/tests/zts/stress.c -L$(prefix)/lib -lphp5 -lpthread
+
+stress: all $(top_builddir)/tests/zts/tideways-stress
+	printf 'extension_dir=%s\nextension=tideways.%s\ntideways.auto_prepend_library=0\n' $(top_builddir)/modules $(SHLIB_DL_SUFFIX_NAME) > $(top_builddir)/tests/zts/php.ini
+	LD_LIBRARY_PATH=$(prefix)/lib PHPRC=$(top_builddir)/tests/zts $(top_builddir)/tests/zts/tideways-stress $(STRESS_ARGS)
+
+.PHONY: stress
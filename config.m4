@@ -2,6 +2,9 @@
 PHP_ARG_ENABLE(tideways, whether to enable Tideways support,
 [ --enable-tideways      Enable Tideways support])
 
+PHP_ARG_WITH(tideways-curl, whether to link libcurl for curl spans,
+[ --with-tideways-curl[=DIR]  Link libcurl for curl spans, "no" falls back to curl_getinfo()], yes, no)
+
 AC_DEFUN([AC_TIDEWAYS_CLOCK],
 [
   have_clock_gettime=no
@@ -72,10 +75,80 @@ AC_DEFUN([AC_TIDEWAYS_CLOCK],
   fi
 ])
 
+dnl libcurl has to be the one ext/curl uses, the handles are shared, and the
+dnl handle is taken from ext/curl's php_curl struct, which is only used when
+dnl its installed header compiles. Linking is optional and a failed check only
+dnl falls back to curl_getinfo().
+AC_DEFUN([AC_TIDEWAYS_CURL],
+[
+  if test "$PHP_TIDEWAYS_CURL" = "no"; then
+    AC_MSG_NOTICE([libcurl disabled, falling back to curl_getinfo()])
+  else
+    AC_MSG_CHECKING([for libcurl headers])
+
+    if test "$PHP_TIDEWAYS_CURL" != "yes"; then
+      SEARCH_DIRS=$PHP_TIDEWAYS_CURL
+    else
+      SEARCH_DIRS="/usr/local /usr"
+    fi
+
+    for i in $SEARCH_DIRS; do
+      if test -r $i/include/curl/easy.h; then
+        CURL_DIR=$i
+      fi
+    done
+
+    if test -n "$CURL_DIR"; then
+      AC_MSG_RESULT([found in $CURL_DIR])
+
+      AC_MSG_CHECKING([for the php_curl struct in ext/curl/php_curl.h])
+      tideways_saved_CPPFLAGS=$CPPFLAGS
+      CPPFLAGS="$CPPFLAGS $INCLUDES -I$CURL_DIR/include"
+      AC_TRY_COMPILE([
+        #include "php.h"
+        #include "ext/curl/php_curl.h"
+      ], [
+        php_curl *ch = NULL;
+        CURL *cp = ch ? ch->cp : NULL;
+        (void)cp;
+      ], [
+        AC_MSG_RESULT([yes])
+      ], [
+        AC_MSG_RESULT([no, falling back to curl_getinfo()])
+        CURL_DIR=
+      ])
+      CPPFLAGS=$tideways_saved_CPPFLAGS
+    else
+      AC_MSG_RESULT([no, falling back to curl_getinfo()])
+    fi
+
+    if test -n "$CURL_DIR"; then
+      PHP_CHECK_LIBRARY(curl, curl_easy_getinfo, [
+        PHP_ADD_INCLUDE($CURL_DIR/include)
+        PHP_ADD_LIBRARY_WITH_PATH(curl, $CURL_DIR/$PHP_LIBDIR, TIDEWAYS_SHARED_LIBADD)
+        AC_DEFINE([PHP_TIDEWAYS_HAVE_CURL], 1, [do we link libcurl?])
+      ], [
+        AC_MSG_WARN([libcurl in $CURL_DIR does not link, falling back to curl_getinfo()])
+      ], [
+        -L$CURL_DIR/$PHP_LIBDIR
+      ])
+    fi
+  fi
+])
+
 if test "$PHP_TIDEWAYS" != "no"; then
+  AC_MSG_CHECKING([for a supported PHP version])
+  tideways_php_version=`$PHP_CONFIG --vernum 2>/dev/null`
+  if test -n "$tideways_php_version" && test "$tideways_php_version" -ge 70000; then
+    AC_MSG_ERROR([PHP 7 and newer are not supported yet, tideways requires PHP 5.3 to 5.6])
+  fi
+  AC_MSG_RESULT([yes])
+
   AC_TIDEWAYS_CLOCK
+  AC_TIDEWAYS_CURL
 
   PHP_SUBST([LIBS])
   PHP_SUBST([TIDEWAYS_SHARED_LIBADD])
   PHP_NEW_EXTENSION(tideways, tideways.c, $ext_shared)
+  PHP_ADD_MAKEFILE_FRAGMENT
 fi
@@ -0,0 +1,335 @@
+<?php
+
+/**
+ * Overhead benchmark for the Tideways extension.
+ *
+ * Runs a set of synthetic workloads once without profiling as a baseline and
+ * then once per TIDEWAYS_FLAGS_* combination, and reports the overhead per
+ * call and the memory held by the profiler while it is enabled. The calls are
+ * counted once per workload from a profile without flags, flags like
+ * NO_HIERACHICAL or NO_BUILTINS leave the profile empty or smaller while the
+ * workload still makes the same calls.
+ *
+ * Usage: php tests/benchmark.php [--quick] [--workload=<name>] [--iterations=<n>]
+ *                                [--max-overhead=<ns>]
+ *
+ *   --quick           only run no flags, each flag on its own and all flags,
+ *                     instead of every combination
+ *   --workload        only run the named workload (may be repeated)
+ *   --iterations      repetitions per measurement, the fastest one counts
+ *   --max-overhead    exit with status 1 when any per-call overhead in
+ *                     nanoseconds exceeds this value
+ *
+ * Usually invoked through "make benchmark", pass options with
+ * BENCHMARK_ARGS="--quick".
+ */
+
+if (!extension_loaded('tideways')) {
+    fwrite(STDERR, "tideways extension is not loaded\n");
+    exit(2);
+}
+
+$options = array(
+    'quick' => false,
+    'workload' => array(),
+    'iterations' => 3,
+    'max-overhead' => null,
+);
+
+foreach (array_slice($argv, 1) as $arg) {
+    if ($arg === '--quick') {
+        $options['quick'] = true;
+    } else if (preg_match('(^--(workload|iterations|max-overhead)=(.+)$)', $arg, $match)) {
+        if ($match[1] === 'workload') {
+            $options['workload'][] = $match[2];
+        } else {
+            $options[$match[1]] = (int)$match[2];
+        }
+    } else {
+        fwrite(STDERR, "Unknown option: $arg\n");
+        exit(2);
+    }
+}
+
+/* Workloads */
+
+function bench_recursion($depth)
+{
+    return $depth === 0 ? 0 : 1 + bench_recursion($depth - 1);
+}
+
+function bench_workload_recursion()
+{
+    for ($i = 0; $i < 100; $i++) {
+        bench_recursion(200);
+    }
+}
+
+function bench_tiny_a($x) { return $x + 1; }
+function bench_tiny_b($x) { return bench_tiny_a($x) * 2; }
+function bench_tiny_c($x) { return bench_tiny_b($x) - 1; }
+
+function bench_workload_tiny_functions()
+{
+    $sum = 0;
+
+    for ($i = 0; $i < 10000; $i++) {
+        $sum += bench_tiny_c($i);
+    }
+
+    return $sum;
+}
+
+function bench_workload_builtins()
+{
+    $result = 0;
+
+    for ($i = 0; $i < 5000; $i++) {
+        $string = str_repeat('tideways', 4);
+        $result += strlen(str_replace('way', 'WAY', $string));
+        $result += count(explode('W', strtoupper($string)));
+        $result += array_sum(array_map('intval', array('1', '2', '3')));
+        $result += crc32(substr($string, 0, 8));
+    }
+
+    return $result;
+}
+
+function bench_workload_sql_spans()
+{
+    for ($i = 0; $i < 2000; $i++) {
+        $span = tideways_span_create('sql');
+        tideways_span_timer_start($span);
+        $sql = sprintf('SELECT * FROM users WHERE id = %d', $i);
+        tideways_span_timer_stop($span);
+        tideways_span_annotate($span, array('sql' => $sql));
+    }
+}
+
+class BenchEventDispatcher
+{
+    private $listeners = array();
+
+    public function addListener($event, $listener)
+    {
+        $this->listeners[$event][] = $listener;
+    }
+
+    public function dispatch($event, $payload)
+    {
+        if (!isset($this->listeners[$event])) {
+            return $payload;
+        }
+
+        foreach ($this->listeners[$event] as $listener) {
+            $payload = call_user_func($listener, $payload);
+        }
+
+        return $payload;
+    }
+}
+
+class BenchController
+{
+    public function __call($method, $args)
+    {
+        return $this->render($method, $args[0]);
+    }
+
+    private function render($template, $data)
+    {
+        return htmlspecialchars($template . ':' . $data);
+    }
+}
+
+class BenchKernel
+{
+    private $dispatcher;
+    private $controller;
+
+    public function __construct()
+    {
+        $this->dispatcher = new BenchEventDispatcher();
+        $this->controller = new BenchController();
+
+        $this->dispatcher->addListener('request', array($this, 'onRequest'));
+        $this->dispatcher->addListener('request', function ($payload) {
+            return $payload . '?';
+        });
+        $this->dispatcher->addListener('response', 'trim');
+    }
+
+    public function onRequest($payload)
+    {
+        return strtolower($payload);
+    }
+
+    public function handle($path)
+    {
+        $request = $this->dispatcher->dispatch('request', $path);
+        $response = call_user_func_array(array($this->controller, 'show'), array($request));
+
+        return $this->dispatcher->dispatch('response', $response);
+    }
+}
+
+function bench_workload_framework()
+{
+    $kernel = new BenchKernel();
+
+    for ($i = 0; $i < 2000; $i++) {
+        $kernel->handle('/Users/' . $i);
+    }
+}
+
+/* Measurement */
+
+function bench_now()
+{
+    return function_exists('hrtime') ? hrtime(true) : (int)(microtime(true) * 1e9);
+}
+
+function bench_measure($workload, $flags, $iterations)
+{
+    $best = null;
+    $memory = 0;
+
+    for ($i = 0; $i < $iterations; $i++) {
+        $memoryBefore = memory_get_usage();
+
+        if ($flags !== null) {
+            tideways_enable($flags);
+        }
+
+        $start = bench_now();
+        call_user_func($workload);
+        $duration = bench_now() - $start;
+
+        if ($flags !== null) {
+            $profilerMemory = memory_get_usage() - $memoryBefore;
+            tideways_disable();
+            $memory = max($memory, $profilerMemory);
+        }
+
+        if ($best === null || $duration < $best) {
+            $best = $duration;
+        }
+    }
+
+    return array('time' => $best, 'memory' => $memory);
+}
+
+function bench_count_calls($workload)
+{
+    $calls = 0;
+
+    tideways_enable(0);
+    call_user_func($workload);
+    $profile = tideways_disable();
+
+    foreach ((array)$profile as $metrics) {
+        if (isset($metrics['ct'])) {
+            $calls += $metrics['ct'];
+        }
+    }
+
+    return $calls;
+}
+
+function bench_flag_combinations($flags, $quick)
+{
+    $all = array_sum($flags);
+
+    if ($quick) {
+        return array_unique(array_merge(array(0), array_values($flags), array($all)));
+    }
+
+    $combinations = array();
+
+    for ($mask = 0; $mask <= $all; $mask++) {
+        if (($mask & ~$all) === 0) {
+            $combinations[] = $mask;
+        }
+    }
+
+    return $combinations;
+}
+
+function bench_flag_names($mask, $flags)
+{
+    $names = array();
+
+    foreach ($flags as $name => $value) {
+        if ($mask & $value) {
+            $names[] = substr($name, strlen('TIDEWAYS_FLAGS_'));
+        }
+    }
+
+    return $names ? implode('|', $names) : '0';
+}
+
+$flags = array();
+foreach (get_defined_constants() as $name => $value) {
+    if (strpos($name, 'TIDEWAYS_FLAGS_') === 0) {
+        $flags[$name] = $value;
+    }
+}
+asort($flags);
+
+$workloads = array(
+    'recursion' => 'bench_workload_recursion',
+    'tiny_functions' => 'bench_workload_tiny_functions',
+    'builtins' => 'bench_workload_builtins',
+    'sql_spans' => 'bench_workload_sql_spans',
+    'framework' => 'bench_workload_framework',
+);
+
+if ($options['workload']) {
+    $unknown = array_diff($options['workload'], array_keys($workloads));
+
+    if ($unknown) {
+        fwrite(STDERR, 'Unknown workload: ' . implode(', ', $unknown) . "\n");
+        exit(2);
+    }
+
+    $workloads = array_intersect_key($workloads, array_flip($options['workload']));
+}
+
+$combinations = bench_flag_combinations($flags, $options['quick']);
+$iterations = max(1, $options['iterations']);
+$exceeded = array();
+
+printf("PHP %s, tideways %s, %d flag combinations, best of %d\n\n",
+    PHP_VERSION, phpversion('tideways'), count($combinations), $iterations);
+
+foreach ($workloads as $name => $workload) {
+    $baseline = bench_measure($workload, null, $iterations);
+    $calls = max(1, bench_count_calls($workload));
+
+    printf("%s: baseline %.2f ms, %d calls\n", $name, $baseline['time'] / 1e6, $calls);
+    printf("  %-60s %10s %12s %10s\n", 'flags', 'time ms', 'ns/call', 'memory KB');
+
+    foreach ($combinations as $mask) {
+        $result = bench_measure($workload, $mask, $iterations);
+        $overhead = ($result['time'] - $baseline['time']) / $calls;
+
+        printf("  %-60s %10.2f %12.1f %10.1f\n",
+            bench_flag_names($mask, $flags),
+            $result['time'] / 1e6,
+            $overhead,
+            $result['memory'] / 1024
+        );
+
+        if ($options['max-overhead'] !== null && $overhead > $options['max-overhead']) {
+            $exceeded[] = sprintf('%s [%s] %.1f ns/call', $name, bench_flag_names($mask, $flags), $overhead);
+        }
+    }
+
+    echo "\n";
+}
+
+if ($exceeded) {
+    fwrite(STDERR, sprintf("Overhead above %d ns/call:\n  %s\n",
+        $options['max-overhead'], implode("\n  ", $exceeded)));
+    exit(1);
+}
@@ -0,0 +1,27 @@
+--TEST--
+Tideways: Include file bodies as run_init frames
+--FILE--
+<?php
+
+include_once __DIR__ . '/common.php';
+
+tideways_enable(TIDEWAYS_FLAGS_RUN_INIT);
+
+include_once __DIR__ . '/tideways_004_inc.php';
+include_once __DIR__ . '/tideways_004_inc.php';
+eval('strlen("Hello World!");');
+
+$output = tideways_disable();
+
+print_canonical($output);
+?>
+--EXPECT--
+abc,def,ghi
+I am in foo()...
+main()                                  : ct=       1; wt=*;
+main()==>run_init::tests/tideways_004_inc.php: ct=       1; wt=*;
+main()==>strlen                         : ct=       1; wt=*;
+main()==>tideways_disable               : ct=       1; wt=*;
+run_init::tests/tideways_004_inc.php==>explode: ct=       1; wt=*;
+run_init::tests/tideways_004_inc.php==>foo: ct=       1; wt=*;
+run_init::tests/tideways_004_inc.php==>implode: ct=       1; wt=*;
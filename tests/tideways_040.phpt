@@ -0,0 +1,26 @@
+--TEST--
+Tideways: Attribute garbage collection runs to the triggering function
+--FILE--
+<?php
+
+function make_cycles() {
+    for ($i = 0; $i < 20000; $i++) {
+        $a = new stdClass;
+        $a->self = $a;
+    }
+}
+
+gc_enable();
+tideways_enable();
+
+make_cycles();
+
+$output = tideways_disable();
+
+var_dump($output['main()==>make_cycles']['gc'] >= 1);
+var_dump($output['main()==>make_cycles']['gcc'] > 0);
+var_dump(isset($output['main()']['gc']));
+--EXPECT--
+bool(true)
+bool(true)
+bool(false)
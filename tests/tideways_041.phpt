@@ -0,0 +1,29 @@
+--TEST--
+Tideways: Count errors per kind and function
+--FILE--
+<?php
+
+function noisy() {
+    for ($i = 0; $i < 3; $i++) {
+        $x = @$undefined;
+    }
+    @trigger_error("old", E_USER_DEPRECATED);
+}
+
+tideways_enable();
+
+noisy();
+
+$output = tideways_disable();
+
+echo $output['main()==>noisy']['en'], "\n";
+echo $output['noisy==>trigger_error']['ed'], "\n";
+
+$spans = tideways_get_spans();
+echo $spans[0]['a']['en'], " ", $spans[0]['a']['ed'], "\n";
+var_dump(isset($spans[0]['a']['ew']));
+--EXPECT--
+3
+1
+3 1
+bool(false)
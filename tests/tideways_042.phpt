@@ -0,0 +1,37 @@
+--TEST--
+Tideways: Count thrown exceptions per class and function
+--FILE--
+<?php
+
+class NotFoundException extends Exception {}
+
+function find($id) {
+    if ($id % 2) {
+        throw new NotFoundException();
+    }
+
+    throw new RuntimeException();
+}
+
+tideways_enable();
+
+for ($i = 0; $i < 3; $i++) {
+    try {
+        find($i);
+    } catch (Exception $e) {
+    }
+}
+
+$output = tideways_disable();
+
+echo $output['main()==>find']['xct'], "\n";
+
+$spans = tideways_get_spans();
+echo $spans[0]['a']['xct'], "\n";
+echo $spans[0]['a']['exceptions'], "\n";
+var_dump(isset($spans[0]['a']['xwt']));
+--EXPECT--
+3
+3
+2 RuntimeException, 1 NotFoundException
+bool(true)
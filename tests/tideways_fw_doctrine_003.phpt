@@ -0,0 +1,24 @@
+--TEST--
+Tideways: Doctrine persister spans follow reused object handles
+--FILE--
+<?php
+
+include __DIR__ . "/common.php";
+include __DIR__ . "/tideways_doctrine.php";
+
+tideways_enable();
+
+$persister = new \Doctrine\ORM\Persisters\BasicEntityPersister("Foo");
+$persister->load();
+unset($persister);
+
+$persister = new \Doctrine\ORM\Persisters\BasicEntityPersister("Bar");
+$persister->load();
+$persister->load();
+
+print_spans(tideways_get_spans());
+tideways_disable();
+--EXPECT--
+app: 1 timers - 
+doctrine.load: 1 timers - title=Foo
+doctrine.load: 2 timers - title=Bar
@@ -1,5 +1,5 @@
 --TEST--
-Tideways: Autodetect file_get_contents() HTTP Spans
+Tideways: HTTP Spans for the http stream wrapper
 --FILE--
 <?php
 
@@ -20,4 +20,4 @@ tideways_disable();
 app: 1 timers - 
 http: 1 timers - url=http://localhost
 http: 1 timers - url=http://localhost:8080
-http: 1 timers - url=http://localhost/phpinfo.php?query=param
+http: 1 timers - url=http://localhost/phpinfo.php
@@ -25,5 +25,5 @@ print_spans(tideways_get_spans());
 tideways_disable();
 --EXPECTF--
 app: 1 timers - 
-http: 1 timers - url=http://localhost/phpinfo.php
-http: 1 timers - url=http://localhost/phpinfo.php
+http: 1 timers - dns=%d total=%d url=http://localhost/phpinfo.php
+http: 1 timers - dns=%d total=%d url=http://localhost/phpinfo.php
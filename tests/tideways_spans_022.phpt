@@ -3,12 +3,25 @@ Tideways: Limit Size of String Annotation generated from Internal APIs to 1000
 --FILE--
 <?php
 
+use Symfony\Component\EventDispatcher\Event;
+use Symfony\Component\EventDispatcher\EventDispatcher;
+
+include_once dirname(__FILE__).'/tideways_events1.php';
+
+function render_template($name) {}
+
 tideways_enable();
+tideways_span_watch('render_template', array('category' => 'view', 'title' => 0));
 
-@file_get_contents("http://localhost/?" . str_repeat("a", 2000));
+$dispatcher = new EventDispatcher();
+$dispatcher->dispatch(str_repeat("a", 2000), new Event());
+
+render_template(str_repeat("b", 2000));
 
 tideways_disable();
 $spans = tideways_get_spans();
-echo strlen($spans[1]['a']['url']);
+echo strlen($spans[1]['a']['title']), "\n";
+echo strlen($spans[2]['a']['title']), "\n";
 --EXPECTF--
 1000
+1000
@@ -0,0 +1,40 @@
+--TEST--
+Tideways: Watch with declarative span specification
+--FILE--
+<?php
+
+include __DIR__ . '/common.php';
+
+function fetch($method, $url, $retries) {
+}
+
+class Repository {
+    private $table = 'users';
+    public function find($id) {}
+}
+
+tideways_enable();
+tideways_span_watch('fetch', array(
+    'category' => 'http',
+    'title' => 1,
+    'annotations' => array('method' => 0, 'retries' => 2, 'missing' => 5),
+));
+tideways_span_watch('Repository::find', array(
+    'category' => 'sql',
+    'title' => 'table',
+    'annotations' => array('id' => 0),
+));
+tideways_span_watch('Repository::__construct', array());
+
+fetch('GET', 'http://localhost/api', 3);
+
+$repository = new Repository();
+$repository->find(42);
+
+tideways_disable();
+
+print_spans(tideways_get_spans());
+--EXPECTF--
+app: 1 timers - cpu=%d
+http: 1 timers - method=GET retries=3 title=http://localhost/api
+sql: 1 timers - id=42 title=users
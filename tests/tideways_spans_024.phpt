@@ -0,0 +1,33 @@
+--TEST--
+Tideways: Span watch definitions loaded from tideways.span_watch_file
+--INI--
+tideways.span_watch_file={PWD}/tideways_spans_024.watch
+--FILE--
+<?php
+
+namespace Acme\Http {
+    class Client {
+        private $service = 'billing';
+        public function send($method, $url) {}
+    }
+}
+
+namespace {
+    include __DIR__ . '/common.php';
+
+    function acme_cache_get($key) {}
+
+    tideways_enable();
+
+    $client = new Acme\Http\Client();
+    $client->send('POST', 'http://billing/invoices');
+    acme_cache_get('foo');
+
+    tideways_disable();
+
+    print_spans(tideways_get_spans());
+}
+--EXPECTF--
+app: 1 timers - cpu=%d
+http: 1 timers - method=POST service=billing title=http://billing/invoices
+cache: 1 timers - title=acme_cache_get
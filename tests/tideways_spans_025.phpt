@@ -0,0 +1,32 @@
+--TEST--
+Tideways: Built-in callback packs selected by tideways.framework
+--INI--
+tideways.framework=wordpress
+--FILE--
+<?php
+
+include __DIR__ . '/common.php';
+
+function get_sidebar() {}
+function drupal_alter($hook) {}
+
+echo "framework=wordpress\n";
+tideways_enable();
+get_sidebar();
+drupal_alter('form');
+tideways_disable();
+print_spans(tideways_get_spans());
+
+echo "framework=oxid\n";
+ini_set('tideways.framework', 'oxid');
+tideways_enable();
+get_sidebar();
+drupal_alter('form');
+tideways_disable();
+print_spans(tideways_get_spans());
+--EXPECTF--
+framework=wordpress
+app: 1 timers - cpu=%d
+php: 1 timers - title=get_sidebar
+framework=oxid
+app: 1 timers - cpu=%d
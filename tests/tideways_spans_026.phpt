@@ -0,0 +1,45 @@
+--TEST--
+Tideways: Watches on parent classes and interfaces apply to overriding methods
+--FILE--
+<?php
+
+include __DIR__ . '/common.php';
+
+interface Renderer {
+    public function render($template);
+}
+
+class BaseTemplate {
+    public function load($name) {}
+}
+
+class PageTemplate extends BaseTemplate implements Renderer {
+    public function load($name) {}
+    public function render($template) {}
+}
+
+class AdminPageTemplate extends PageTemplate {
+    public function load($name) {}
+}
+
+tideways_enable();
+tideways_span_watch('BaseTemplate::load', array('category' => 'view', 'title' => 0));
+tideways_span_watch('Renderer::render', array('category' => 'view', 'title' => 0));
+
+$page = new PageTemplate();
+$page->load('page.html');
+$page->load('page.html');
+$page->render('layout.html');
+
+$admin = new AdminPageTemplate();
+$admin->load('admin.html');
+
+tideways_disable();
+
+print_spans(tideways_get_spans());
+--EXPECTF--
+app: 1 timers - cpu=%d
+view: 1 timers - title=page.html
+view: 1 timers - title=page.html
+view: 1 timers - title=layout.html
+view: 1 timers - title=admin.html
@@ -0,0 +1,56 @@
+--TEST--
+Tideways: Watch functions and public methods by glob pattern
+--FILE--
+<?php
+
+namespace App\Repository {
+    class UserRepository {
+        public function find($id) {}
+        public function findByEmail($email) {}
+        public function save($user) {}
+        private function findInternal() {}
+        public function callInternal() { $this->findInternal(); }
+    }
+}
+
+namespace App\Controller {
+    class UserController {
+        public function showAction() {}
+        public function helper() {}
+    }
+}
+
+namespace {
+    include __DIR__ . '/common.php';
+
+    function render_widget_header() {}
+    function render_page() {}
+
+    tideways_enable();
+    tideways_span_watch('App\Repository\*::find*', array('category' => 'sql'));
+    tideways_span_watch('*controller::*action', 'php');
+    tideways_span_watch('render_widget_?eader');
+
+    $repository = new App\Repository\UserRepository();
+    $repository->find(1);
+    $repository->findByEmail('foo@example.com');
+    $repository->save(null);
+    $repository->callInternal();
+
+    $controller = new App\Controller\UserController();
+    $controller->showAction();
+    $controller->helper();
+
+    render_widget_header();
+    render_page();
+
+    tideways_disable();
+
+    print_spans(tideways_get_spans());
+}
+--EXPECTF--
+app: 1 timers - cpu=%d
+sql: 1 timers - title=App\Repository\UserRepository::find
+sql: 1 timers - title=App\Repository\UserRepository::findByEmail
+php: 1 timers - title=App\Controller\UserController::showAction
+php: 1 timers - title=render_widget_header
@@ -0,0 +1,43 @@
+--TEST--
+Tideways: curl_multi spans per transfer
+--SKIPIF--
+<?php
+if (!extension_loaded('curl')) {
+    echo "skip: curl required\n";
+    die;
+}
+if (!TIDEWAYS_HAVE_CURL) {
+    echo "skip: tideways built without libcurl\n";
+    die;
+}
+--FILE--
+<?php
+
+require_once __DIR__ . '/common.php';
+
+tideways_enable();
+
+$mh = curl_multi_init();
+$handles = array();
+
+foreach (array("http://localhost/a.php", "http://localhost/b.php?foo=bar") as $url) {
+    $ch = curl_init($url);
+    curl_setopt($ch, CURLOPT_RETURNTRANSFER, true);
+    curl_multi_add_handle($mh, $ch);
+    $handles[] = $ch;
+}
+
+do {
+    curl_multi_exec($mh, $running);
+    curl_multi_select($mh, 0.1);
+} while ($running > 0);
+
+curl_multi_remove_handle($mh, $handles[0]);
+curl_multi_close($mh);
+
+print_spans(tideways_get_spans());
+tideways_disable();
+--EXPECTF--
+app: 1 timers - 
+http: 1 timers - %Aurl=http://localhost/a.php
+http: 1 timers - %Aurl=http://localhost/b.php
@@ -0,0 +1,18 @@
+--TEST--
+Tideways: Distributed tracing picks up the incoming trace header
+--ENV--
+HTTP_X_TIDEWAYS_TRACE=00000000000000AB-3
+--INI--
+tideways.distributed_tracing_hosts=localhost, api.example.com
+--FILE--
+<?php
+
+require_once __DIR__ . '/common.php';
+
+tideways_enable();
+var_dump(tideways_trace_id());
+print_spans(tideways_get_spans());
+tideways_disable();
+--EXPECTF--
+string(16) "00000000000000ab"
+app: 1 timers - parent=3 trace=00000000000000ab
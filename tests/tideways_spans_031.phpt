@@ -0,0 +1,15 @@
+--TEST--
+Tideways: Distributed tracing generates a trace id per enable
+--FILE--
+<?php
+
+tideways_enable();
+$first = tideways_trace_id();
+tideways_enable();
+$second = tideways_trace_id();
+tideways_disable();
+
+var_dump(strlen($first), $first !== $second);
+--EXPECTF--
+int(16)
+bool(true)
@@ -0,0 +1,35 @@
+--TEST--
+Tideways: MongoDB\Driver\Manager spans are aggregated per namespace
+--SKIPIF--
+<?php
+if (!extension_loaded('mongodb')) {
+    die('skip: mongodb extension required');
+}
+--FILE--
+<?php
+
+require __DIR__ . '/common.php';
+
+tideways_enable();
+
+$manager = new MongoDB\Driver\Manager("mongodb://127.0.0.1:1/?serverSelectionTimeoutMS=1");
+
+foreach (array("tidewaystest.items", "tidewaystest.items", "tidewaystest.users") as $ns) {
+    try {
+        $manager->executeQuery($ns, new MongoDB\Driver\Query(array()));
+    } catch (MongoDB\Driver\Exception\Exception $e) {
+    }
+}
+
+try {
+    $manager->executeCommand("tidewaystest", new MongoDB\Driver\Command(array("ping" => 1)));
+} catch (MongoDB\Driver\Exception\Exception $e) {
+}
+
+print_spans(tideways_get_spans());
+tideways_disable();
+--EXPECTF--
+app: 1 timers - 
+mongo: 2 timers - collection=tidewaystest.items title=MongoDB\Driver\Manager::executeQuery
+mongo: 1 timers - collection=tidewaystest.users title=MongoDB\Driver\Manager::executeQuery
+mongo: 1 timers - collection=tidewaystest.$cmd title=MongoDB\Driver\Manager::executeCommand
@@ -0,0 +1,51 @@
+--TEST--
+Tideways: Twig template names are resolved once per template class
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+class Twig_Template
+{
+    public static $calls = 0;
+
+    public function getTemplateName()
+    {
+        self::$calls++;
+        return 'base.twig';
+    }
+
+    public function render($variables)
+    {
+    }
+}
+
+class __TwigTemplate_123 extends Twig_Template
+{
+    public function getTemplateName()
+    {
+        self::$calls++;
+        return 'list.twig';
+    }
+}
+
+tideways_enable();
+
+for ($i = 0; $i < 5; $i++) {
+    $template = new __TwigTemplate_123();
+    $template->render(array());
+}
+
+$template = new Twig_Template();
+$template->render(array());
+$template->render(array());
+
+print_spans(tideways_get_spans());
+tideways_disable();
+
+var_dump(Twig_Template::$calls);
+--EXPECT--
+app: 1 timers - 
+view: 5 timers - title=list.twig
+view: 2 timers - title=base.twig
+int(2)
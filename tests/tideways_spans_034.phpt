@@ -0,0 +1,28 @@
+--TEST--
+Tideways: Memcached commands are aggregated into one span per command
+--SKIPIF--
+<?php
+if (!extension_loaded('memcached')) {
+    die('skip: memcached extension required');
+}
+--FILE--
+<?php
+
+require __DIR__ . '/common.php';
+
+tideways_enable();
+
+$memcached = new Memcached();
+
+for ($i = 0; $i < 100; $i++) {
+    $memcached->get("key" . $i);
+}
+
+$memcached->getMulti(array("a", "b", "c"));
+
+print_spans(tideways_get_spans());
+tideways_disable();
+--EXPECTF--
+app: 1 timers - 
+memcache: 1 timers - calls=100 hits=0 keys=100 misses=100 title=Memcached::get wt=%d
+memcache: 1 timers - calls=1 hits=0 keys=3 misses=3 title=Memcached::getMulti wt=%d
@@ -0,0 +1,30 @@
+--TEST--
+Tideways: File I/O is accounted per path prefix with TIDEWAYS_FLAGS_FILE_IO
+--FILE--
+<?php
+
+$dir = sys_get_temp_dir() . '/tideways_io_' . getmypid();
+@mkdir($dir);
+ini_set('tideways.file_io_prefixes', $dir . ', /nonexistent');
+
+tideways_enable(TIDEWAYS_FLAGS_FILE_IO);
+
+file_put_contents($dir . '/cache.txt', 'hello world');
+file_get_contents($dir . '/cache.txt');
+is_file($dir . '/missing.txt');
+@fopen($dir . '/missing.txt', 'r');
+file_get_contents(__FILE__);
+
+tideways_disable();
+
+$spans = tideways_get_spans();
+echo str_replace($dir, 'DIR', $spans[0]['a']['io:' . $dir]), "\n";
+echo isset($spans[0]['a']['io:other']) ? "other\n" : "no other\n";
+echo isset($spans[0]['a']['io:/nonexistent']) ? "nonexistent\n" : "no nonexistent\n";
+
+unlink($dir . '/cache.txt');
+rmdir($dir);
+--EXPECTF--
+open=2 read=%d write=1 stat=1 bytes_read=11 bytes_written=11 wt=%d
+other
+no nonexistent
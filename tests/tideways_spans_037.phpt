@@ -0,0 +1,31 @@
+--TEST--
+Tideways: Count stat probes and include path resolutions on the app span
+--FILE--
+<?php
+
+set_include_path(__DIR__);
+
+tideways_enable();
+
+// access checks, answered without url_stat on plain paths
+for ($i = 0; $i < 2; $i++) {
+    file_exists(__DIR__ . '/missing.php');
+}
+
+is_file(__DIR__ . '/missing.php');
+clearstatcache();
+
+stream_resolve_include_path('common.php');
+
+tideways_disable();
+
+$spans = tideways_get_spans();
+$annotations = $spans[0]["a"];
+var_dump($annotations['sct'] >= 3, $annotations['rct'] >= 1);
+echo str_replace(__DIR__, 'DIR', $annotations['stat_top']), "\n";
+echo $annotations['resolve_top'], "\n";
+--EXPECTF--
+bool(true)
+bool(true)
+3 DIR/missing.php%A
+1 common.php
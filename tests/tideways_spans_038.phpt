@@ -0,0 +1,26 @@
+--TEST--
+Tideways: Compile spans for the slowest files and eval breakdown
+--FILE--
+<?php
+
+tideways_enable();
+
+include __DIR__ . '/tideways_004_inc.php';
+eval("strlen('Hello World!');");
+
+tideways_disable();
+
+$spans = tideways_get_spans();
+$annotations = $spans[0]['a'];
+var_dump($annotations['cct'], $annotations['ect'], isset($annotations['ewt']));
+
+foreach ($spans as $span) {
+    if ($span['n'] === 'compile') {
+        echo $span['a']['title'], "\n";
+    }
+}
+--EXPECTF--
+%Astring(1) "2"
+string(1) "1"
+bool(true)
+tests/tideways_004_inc.php
@@ -0,0 +1,39 @@
+--TEST--
+Tideways: Autoload mode sums up class loads and lists the slowest
+--SKIPIF--
+<?php
+if (PHP_VERSION_ID < 50500) {
+    echo "skip: engine triggered autoloads are only seen with PHP 5.5+\n";
+}
+--FILE--
+<?php
+
+spl_autoload_register(function ($class) {
+    if ($class === 'AutoloadChild') {
+        eval('class AutoloadChild extends AutoloadParent {}');
+    } else if ($class === 'AutoloadParent') {
+        eval('class AutoloadParent {}');
+    }
+});
+
+tideways_enable(TIDEWAYS_FLAGS_AUTOLOAD);
+
+new AutoloadChild();
+class_exists('Missing\Thing');
+
+tideways_disable();
+
+$spans = tideways_get_spans();
+
+foreach ($spans as $span) {
+    if ($span['n'] === 'autoload') {
+        echo $span['a']['title'], " calls=", $span['a']['calls'], " hits=", $span['a']['hits'], " misses=", $span['a']['misses'], "\n";
+    }
+}
+
+$top = explode(', ', preg_replace('(\d+/\d+ )', '', $spans[0]['a']['autoload_top']));
+sort($top);
+echo implode(', ', $top), "\n";
+--EXPECTF--
+spl_autoload_call calls=3 hits=2 misses=1
+AutoloadChild, Missing\Thing
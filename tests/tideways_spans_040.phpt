@@ -0,0 +1,35 @@
+--TEST--
+Tideways: Watches on methods inherited by classes declared after the first call
+--FILE--
+<?php
+
+include __DIR__ . '/common.php';
+
+class Repository {
+    public function find($id) {}
+}
+
+tideways_enable();
+tideways_span_watch('Repository::find', array('category' => 'db', 'title' => 0));
+
+$repository = new Repository();
+$repository->find('parent');
+
+// the child copies the already resolved parent method
+eval('class UserRepository extends Repository {}');
+
+// drops the resolved watches before the next call
+tideways_span_watch('Repository::count', array('category' => 'db'));
+
+$users = new UserRepository();
+$users->find('child');
+$repository->find('parent');
+
+tideways_disable();
+
+print_spans(tideways_get_spans());
+--EXPECTF--
+app: 1 timers - cpu=%d
+db: 1 timers - title=parent
+db: 1 timers - title=child
+db: 1 timers - title=parent
@@ -0,0 +1,43 @@
+--TEST--
+Tideways: Built-in callback packs selected by tideways.callback_packs
+--INI--
+tideways.callback_packs=drupal
+--FILE--
+<?php
+
+include __DIR__ . '/common.php';
+
+function get_sidebar() {}
+function drupal_alter($hook) {}
+
+echo "callback_packs=drupal\n";
+tideways_enable();
+get_sidebar();
+drupal_alter('form');
+tideways_disable();
+print_spans(tideways_get_spans());
+
+echo "callback_packs=php\n";
+ini_set('tideways.callback_packs', 'php');
+tideways_enable();
+get_sidebar();
+drupal_alter('form');
+tideways_disable();
+print_spans(tideways_get_spans());
+
+echo "callback_packs=drupal,wordpress\n";
+ini_set('tideways.callback_packs', 'drupal,wordpress');
+tideways_enable();
+get_sidebar();
+drupal_alter('form');
+tideways_disable();
+print_spans(tideways_get_spans());
+--EXPECTF--
+callback_packs=drupal
+app: 1 timers - cpu=%d
+event: 1 timers - title=form
+callback_packs=php
+app: 1 timers - cpu=%d
+callback_packs=drupal,wordpress
+app: 1 timers - cpu=%d
+event: 1 timers - title=form
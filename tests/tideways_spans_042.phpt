@@ -0,0 +1,26 @@
+--TEST--
+Tideways: Warn about annotations and long lines dropped from tideways.span_watch_file
+--INI--
+tideways.span_watch_file={PWD}/tideways_spans_042.watch
+display_startup_errors=1
+--FILE--
+<?php
+
+include __DIR__ . '/common.php';
+
+function acme_watch($value) {}
+function acme_after($value) {}
+
+tideways_enable();
+acme_watch('x');
+acme_after('y');
+tideways_disable();
+
+$spans = tideways_get_spans();
+echo count($spans[1]['a']), "\n";
+echo $spans[2]['a']['a'], "\n";
+--EXPECTF--
+%Atideways.span_watch_file: Only 16 annotations per function, dropped a17, a18 of acme_watch in %stideways_spans_042.watch on line 2%A
+%Atideways.span_watch_file: Line longer than 1023 characters skipped in %stideways_spans_042.watch on line 4%A
+16
+y
@@ -0,0 +1,39 @@
+--TEST--
+Tideways: curl_multi transfers still attached when profiling stops
+--SKIPIF--
+<?php
+if (!extension_loaded('curl')) {
+    echo "skip: curl required\n";
+    die;
+}
+if (!TIDEWAYS_HAVE_CURL) {
+    echo "skip: tideways built without libcurl\n";
+    die;
+}
+--FILE--
+<?php
+
+require_once __DIR__ . '/common.php';
+
+tideways_enable();
+
+$mh = curl_multi_init();
+
+$ch = curl_init("http://localhost/a.php");
+curl_setopt($ch, CURLOPT_RETURNTRANSFER, true);
+curl_multi_add_handle($mh, $ch);
+
+do {
+    curl_multi_exec($mh, $running);
+    curl_multi_select($mh, 0.1);
+} while ($running > 0);
+
+// added, but never executed
+$idle = curl_init("http://localhost/b.php");
+curl_multi_add_handle($mh, $idle);
+
+tideways_disable();
+print_spans(tideways_get_spans());
+--EXPECTF--
+app: 1 timers - cpu=%d
+http: 1 timers - %Aurl=http://localhost/a.php
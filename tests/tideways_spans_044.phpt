@@ -0,0 +1,27 @@
+--TEST--
+Tideways: Autoload mode is ignored with TIDEWAYS_FLAGS_NO_BUILTINS
+--FILE--
+<?php
+
+spl_autoload_register(function ($class) {
+    eval('class ' . $class . ' {}');
+});
+
+tideways_enable(TIDEWAYS_FLAGS_AUTOLOAD | TIDEWAYS_FLAGS_NO_BUILTINS);
+
+new AutoloadIgnored();
+
+tideways_disable();
+
+$spans = tideways_get_spans();
+
+foreach ($spans as $span) {
+    if ($span['n'] === 'autoload') {
+        echo "autoload span\n";
+    }
+}
+
+echo isset($spans[0]['a']['autoload_top']) ? "autoload_top\n" : "no autoload_top\n";
+--EXPECTF--
+Warning: tideways_enable(): TIDEWAYS_FLAGS_AUTOLOAD cannot be combined with TIDEWAYS_FLAGS_NO_BUILTINS and is ignored in %s on line %d
+no autoload_top
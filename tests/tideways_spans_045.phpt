@@ -0,0 +1,27 @@
+--TEST--
+Tideways: Compiles served by the opcode cache are counted as cache hits
+--SKIPIF--
+<?php
+if (!extension_loaded('Zend OPcache')) {
+    echo "skip: opcache needs to be loaded.\n";
+}
+--INI--
+opcache.enable=1
+opcache.enable_cli=1
+opcache.file_update_protection=0
+--FILE--
+<?php
+
+tideways_enable();
+
+include __DIR__ . '/tideways_spans_045_inc.php';
+include __DIR__ . '/tideways_spans_045_inc.php';
+
+tideways_disable();
+
+$spans = tideways_get_spans();
+$annotations = $spans[0]['a'];
+var_dump($annotations['cct'], $annotations['cht']);
+--EXPECTF--
+string(1) "2"
+string(1) "1"
@@ -0,0 +1,5 @@
+<?php
+
+// Included twice by tideways_spans_045.phpt, the second time from the opcode cache.
+
+return 42;
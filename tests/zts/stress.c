@@ -0,0 +1,222 @@
+/*
+ *  Copyright (c) 2014 Qafoo GmbH
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/**
+ * Multi-threaded stress test for thread safe (ZTS) builds, linked against
+ * the embed SAPI and run with "make stress".
+ *
+ * Every thread runs its own request and profiles the same workload over and
+ * over, checking that each profile contains exactly the calls the thread
+ * made. The run is repeated with 1, 2, 4, ... threads up to the number of
+ * CPUs and fails when a profile is wrong or when N threads do less than
+ * min-efficiency times N the work of a single thread.
+ *
+ * Usage: tideways-stress [max-threads [min-efficiency [iterations]]]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sapi/embed/php_embed.h>
+
+#ifndef ZTS
+# error "the stress test needs a thread safe PHP build (--enable-maintainer-zts)"
+#endif
+
+#define STRESS_CALLS 1000
+
+static char stress_setup[] =
+	"function stress_leaf($i) { return $i + 1; }\n"
+	"function stress_work($n) { for ($i = 0; $i < $n; $i++) { stress_leaf($i); } }\n"
+	"function stress_run($n) {\n"
+	"    tideways_enable();\n"
+	"    stress_work($n);\n"
+	"    $profile = tideways_disable();\n"
+	"    return isset($profile['stress_work==>stress_leaf']) ? $profile['stress_work==>stress_leaf']['ct'] : -1;\n"
+	"}\n";
+
+typedef struct stress_thread {
+	pthread_t thread;
+	int iterations;
+	int failures;
+	double finished;
+} stress_thread;
+
+static pthread_barrier_t stress_start;
+
+static double stress_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int stress_request(stress_thread *job, int ready TSRMLS_DC)
+{
+	char code[32];
+	zval retval;
+	int i;
+
+	snprintf(code, sizeof(code), "stress_run(%d)", STRESS_CALLS);
+
+	zend_try {
+		for (i = 0; ready && i < job->iterations; i++) {
+			if (zend_eval_string(code, &retval, "stress run" TSRMLS_CC) == FAILURE) {
+				job->failures++;
+				continue;
+			}
+
+			if (Z_TYPE(retval) != IS_LONG || Z_LVAL(retval) != STRESS_CALLS) {
+				job->failures++;
+			}
+
+			zval_dtor(&retval);
+		}
+	} zend_catch {
+		ready = 0;
+	} zend_end_try();
+
+	return ready;
+}
+
+static void *stress_thread_main(void *arg)
+{
+	stress_thread *job = (stress_thread *)arg;
+	void ***tsrm_ls = (void ***) ts_resource(0);
+	int ready = 0;
+
+	SG(options) |= SAPI_OPTION_NO_CHDIR;
+	SG(headers_sent) = 1;
+	SG(request_info).no_headers = 1;
+
+	if (php_request_startup(TSRMLS_C) == SUCCESS) {
+		zend_try {
+			ready = zend_eval_string(stress_setup, NULL, "stress setup" TSRMLS_CC) == SUCCESS;
+		} zend_end_try();
+	}
+
+	/* every thread waits here, even when its request failed to start */
+	pthread_barrier_wait(&stress_start);
+
+	if (!stress_request(job, ready TSRMLS_CC)) {
+		job->failures = job->iterations;
+	}
+
+	job->finished = stress_now();
+
+	php_request_shutdown(NULL);
+	ts_free_thread();
+
+	return NULL;
+}
+
+/* Calls per second with the given number of threads, -1 on failures */
+static double stress_run(int threads, int iterations)
+{
+	stress_thread *jobs = calloc(threads, sizeof(stress_thread));
+	double start, finished = 0;
+	int i, failures = 0;
+
+	pthread_barrier_init(&stress_start, NULL, threads + 1);
+
+	for (i = 0; i < threads; i++) {
+		jobs[i].iterations = iterations;
+		pthread_create(&jobs[i].thread, NULL, stress_thread_main, &jobs[i]);
+	}
+
+	pthread_barrier_wait(&stress_start);
+	start = stress_now();
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(jobs[i].thread, NULL);
+
+		failures += jobs[i].failures;
+
+		if (jobs[i].finished > finished) {
+			finished = jobs[i].finished;
+		}
+	}
+
+	pthread_barrier_destroy(&stress_start);
+	free(jobs);
+
+	if (failures > 0) {
+		fprintf(stderr, "%d threads: %d profiles without %d calls\n", threads, failures, STRESS_CALLS);
+		return -1;
+	}
+
+	return (double) threads * iterations * STRESS_CALLS / (finished - start);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+	double min_efficiency = argc > 2 ? atof(argv[2]) : 0.7;
+	int iterations = argc > 3 ? atoi(argv[3]) : 200;
+	double single = 0, rate, efficiency;
+	int threads, status = 0;
+	void ***tsrm_ls = NULL;
+
+	if (max_threads < 1) {
+		max_threads = 1;
+	}
+
+	php_embed_init(argc, argv, &tsrm_ls);
+
+	if (!zend_hash_exists(&module_registry, "tideways", sizeof("tideways"))) {
+		fprintf(stderr, "tideways extension is not loaded, check PHPRC\n");
+		php_embed_shutdown(TSRMLS_C);
+		return 2;
+	}
+
+	printf("%8s %14s %11s\n", "threads", "calls/s", "efficiency");
+
+	for (threads = 1; threads <= max_threads; threads = (threads < max_threads && threads * 2 > max_threads) ? max_threads : threads * 2) {
+		rate = stress_run(threads, iterations);
+
+		if (rate < 0) {
+			status = 1;
+			break;
+		}
+
+		if (threads == 1) {
+			single = rate;
+		}
+
+		efficiency = rate / (single * threads);
+		printf("%8d %14.0f %10.0f%%\n", threads, rate, efficiency * 100);
+
+		if (efficiency < min_efficiency) {
+			fprintf(stderr, "%d threads reach %.0f%% of linear scaling, expected at least %.0f%%\n",
+				threads, efficiency * 100, min_efficiency * 100);
+			status = 1;
+		}
+
+		if (threads == max_threads) {
+			break;
+		}
+	}
+
+	php_embed_shutdown(TSRMLS_C);
+
+	return status;
+}
@@ -21,6 +21,7 @@
 #endif
 
 #include <stdlib.h>
+#include <assert.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -37,8 +38,12 @@
 #include "php_tideways.h"
 #include "zend_extensions.h"
 #include "zend_gc.h"
+#include "zend_exceptions.h"
 
 #include "ext/standard/url.h"
+#include "ext/standard/php_lcg.h"
+#include "ext/standard/php_smart_str.h"
+#include "SAPI.h"
 #include "ext/pdo/php_pdo_driver.h"
 #include "zend_stream.h"
 
@@ -46,6 +51,7 @@
 #if PHP_VERSION_ID > 50399
 #include <curl/curl.h>
 #include <curl/easy.h>
+#include "ext/curl/php_curl.h"
 #endif
 #endif
 
@@ -79,12 +85,52 @@
 #define TIDEWAYS_FLAGS_NO_COMPILE    0x0010 /* do not profile require/include/eval */
 #define TIDEWAYS_FLAGS_NO_SPANS      0x0020
 #define TIDEWAYS_FLAGS_NO_HIERACHICAL 0x0040
+#define TIDEWAYS_FLAGS_FILE_IO       0x0080 /* account plain file I/O per path prefix */
+#define TIDEWAYS_FLAGS_AUTOLOAD      0x0100 /* measure class loads through autoloaders */
+#define TIDEWAYS_FLAGS_RUN_INIT      0x0200 /* profile include/require file bodies as run_init::<file> */
+
+/* Packs of built-in trace callbacks, selected with tideways.framework and
+ * tideways.callback_packs */
+#define TW_PACK_PHP         0x00001 /* always enabled */
+#define TW_PACK_HTTP        0x00002
+#define TW_PACK_SQL         0x00004
+#define TW_PACK_CACHE       0x00008
+#define TW_PACK_QUEUE       0x00010
+#define TW_PACK_MONGO       0x00020
+#define TW_PACK_TWIG        0x00040
+#define TW_PACK_SMARTY      0x00080
+#define TW_PACK_SYMFONY     0x00100
+#define TW_PACK_DOCTRINE    0x00200
+#define TW_PACK_LARAVEL     0x00400
+#define TW_PACK_MAGENTO     0x00800
+#define TW_PACK_SHOPWARE    0x01000
+#define TW_PACK_ZEND        0x02000
+#define TW_PACK_WORDPRESS   0x04000
+#define TW_PACK_OXID        0x08000
+#define TW_PACK_DRUPAL      0x10000
+#define TW_PACK_GENERIC     (TW_PACK_PHP | TW_PACK_HTTP | TW_PACK_SQL | TW_PACK_CACHE | TW_PACK_QUEUE | TW_PACK_MONGO)
+#define TW_PACK_ALL         0xFFFFFFFF
 
 /* Constant for ignoring functions, transparent to hierarchical profile */
 #define TIDEWAYS_MAX_FILTERED_FUNCTIONS  256
 #define TIDEWAYS_FILTERED_FUNCTION_SIZE                           \
                ((TIDEWAYS_MAX_FILTERED_FUNCTIONS + 7)/8)
 #define TIDEWAYS_MAX_ARGUMENT_LEN 256
+#define TIDEWAYS_MAX_URL_CACHE 512
+#define TIDEWAYS_TRACE_ID_LEN 32
+#define TIDEWAYS_TRACE_HEADER "X-Tideways-Trace"
+
+#if PHP_VERSION_ID >= 50400
+#define TW_STREAM_CONST const
+#else
+#define TW_STREAM_CONST
+#endif
+
+#define TIDEWAYS_MAX_STAT_PATHS 1024
+#define TIDEWAYS_TOP_COUNTS 5
+#define TIDEWAYS_TOP_COMPILES 10
+#define TW_ERROR_KINDS 5
+#define TIDEWAYS_TOP_AUTOLOADS 10
 
 #if !defined(uint64)
 typedef unsigned long long uint64;
@@ -96,8 +142,12 @@ typedef unsigned int uint32;
 typedef unsigned char uint8;
 #endif
 
-#define register_trace_callback(function_name, cb) zend_hash_update(hp_globals.trace_callbacks, function_name, sizeof(function_name), &cb, sizeof(tw_trace_callback*), NULL);
-#define register_trace_callback_len(function_name, len, cb) zend_hash_update(hp_globals.trace_callbacks, function_name, len+1, &cb, sizeof(tw_trace_callback*), NULL);
+/* Built-in callbacks are registered once per process in MINIT for the
+ * callback pack currently in scope as "pack", callbacks registered during a
+ * request go into the per-request overlay table. */
+#define register_trace_callback(function_name, cb) hp_register_builtin_trace_callback(function_name, sizeof(function_name), cb, NULL, pack TSRMLS_CC);
+#define register_trace_callback_with_end(function_name, cb, end) hp_register_builtin_trace_callback(function_name, sizeof(function_name), cb, end, pack TSRMLS_CC);
+#define register_trace_callback_len(function_name, len, cb) hp_register_request_trace_callback(function_name, len, cb TSRMLS_CC);
 
 /**
  * *****************************
@@ -122,6 +172,9 @@ typedef struct hp_entry_t {
 	struct hp_entry_t      *prev_hprof;    /* ptr to prev entry being profiled */
 	uint8                   hash_code;     /* hash_code for the function name  */
 	long int				span_id; /* span id of this entry if any, otherwise -1 */
+	void                  (*span_end)(long span_id, void **args, int args_len, zval *object TSRMLS_DC); /* called on return, span_id is -1 without a span */
+	zend_uint               gc_runs;       /* garbage collection runs triggered by this frame */
+	zend_uint               gc_collected;  /* items collected by these runs */
 } hp_entry_t;
 
 typedef struct hp_string {
@@ -139,6 +192,32 @@ typedef struct tw_watch_callback {
 	zend_fcall_info_cache fcic;
 } tw_watch_callback;
 
+/* Declarative span watch, executed natively without calling into userland. */
+#define TW_WATCH_EXTRACT_NONE     0
+#define TW_WATCH_EXTRACT_ARGUMENT 1
+#define TW_WATCH_EXTRACT_PROPERTY 2
+
+typedef struct tw_watch_extractor {
+	int type;
+	long argument;     /* argument index for TW_WATCH_EXTRACT_ARGUMENT */
+	char *property;    /* property name for TW_WATCH_EXTRACT_PROPERTY */
+	int property_len;
+} tw_watch_extractor;
+
+typedef struct tw_watch_annotation {
+	char *key;
+	tw_watch_extractor extractor;
+} tw_watch_annotation;
+
+typedef struct tw_watch_spec {
+	char *category;
+	int category_len;
+	tw_watch_extractor title;
+	tw_watch_annotation *annotations;
+	int annotations_len;
+	int persistent;
+} tw_watch_spec;
+
 /* Tideways's global state.
  *
  * This structure is instantiated once.  Initialize defaults for attributes in
@@ -178,8 +257,6 @@ typedef struct hp_global_t {
 
 	hp_string		*exception_function;
 
-	double timebase_factor;
-
 	/* Tideways flags */
 	uint32 tideways_flags;
 
@@ -192,46 +269,194 @@ typedef struct hp_global_t {
 	hp_function_map *filtered_functions;
 
 	HashTable *trace_watch_callbacks;
-	HashTable *trace_callbacks;
+	HashTable *trace_watch_specs;
+	HashTable *trace_callbacks; /* per-request overlay, allocated on first registration */
+	uint32 trace_packs; /* packs enabled for the current request */
+
+	/* zend_op_array* => tw_resolved_watch, cleared on new registrations */
+	HashTable *resolved_watches;
+	int resolved_stale;
+
+	/* tw_watch_pattern list, matched once per function */
+	zend_llist watch_patterns;
 	HashTable *span_cache;
+	HashTable *url_cache; /* raw url => summary, see hp_get_file_summary() */
+	int url_collapse_numeric;
+	HashTable *curl_multi_transfers; /* easy handle resource id => tw_curl_transfer */
+
+	/* distributed tracing */
+	char trace_id[TIDEWAYS_TRACE_ID_LEN + 1];
+	char incoming_trace_id[TIDEWAYS_TRACE_ID_LEN + 1]; /* from the X-Tideways-Trace request header */
+	long incoming_parent_span;
+	HashTable *tracing_hosts; /* lowercased hosts from tideways.distributed_tracing_hosts */
+	HashTable *curl_traces; /* easy handle resource id => tw_curl_trace */
+	HashTable *curl_restored; /* easy handle resource id => header list set after a traced transfer, kept for the request */
+
+	HashTable *mongo_cursors; /* cursor object handle => tw_mongo_cursor */
+	HashTable *object_hooks; /* object storage => tw_object_hook, for objects with state keyed by handle */
+	HashTable *class_spans; /* zend_class_entry* => span id, for titles derived from the class */
+	HashTable *object_spans; /* object handle => span id, for titles derived from the object */
+	HashTable *span_aggregates; /* span id => tw_span_aggregate, for spans collecting many calls */
+	zval *internal_return; /* return value of the internal function whose span ends */
+	HashTable *http_streams; /* php_stream* => tw_http_stream, open http stream wrapper streams */
+	dtor_func_t regular_list_dtor; /* EG(regular_list) destructor while streams are tracked */
+	struct tw_http_stream *http_opening; /* stream in tw_http_stream_opener(), for the connect notification */
+
+	/* TIDEWAYS_FLAGS_FILE_IO, one bucket per tideways.file_io_prefixes entry plus "other" */
+	struct tw_io_bucket *io_buckets;
+	int io_buckets_len;
+	HashTable *io_streams; /* php_stream* => bucket index */
 
 	zend_uint gc_runs; /* number of garbage collection runs */
 	zend_uint gc_collected; /* number of collected items in garbage run */
+	zend_uint gc_seen_runs; /* GC_G(gc_runs) at the last function begin or end */
+	zend_uint gc_seen_collected;
+	long error_counts[TW_ERROR_KINDS]; /* errors per kind, see hp_error_kind() */
+	HashTable *exception_classes; /* class name => thrown exceptions */
+	long exception_count;
+	double exception_wt; /* time from throw to the first catch block reached */
+	uint64 exception_throw_tsc; /* time of the last throw not caught yet, 0 if none */
+
 	int compile_count;
+	int compile_hits; /* zend_compile_file calls served by the opcode cache */
+	int eval_count;
+	double eval_wt;
+	struct tw_compile_entry *compile_top; /* slowest real file compiles, TIDEWAYS_TOP_COMPILES at most */
+	int compile_top_len;
+
+	/* TIDEWAYS_FLAGS_AUTOLOAD */
+	long autoload_span;
+	int autoload_depth; /* nested class loads, e.g. parents loaded while compiling a child */
+	double autoload_compile_start; /* compile_wt when the outermost load began */
+	double autoload_compile_wt;
+	struct tw_autoload_entry *autoload_top; /* slowest class loads, TIDEWAYS_TOP_AUTOLOADS at most */
+	int autoload_top_len;
+	long stat_count; /* url_stat calls on the plain files wrapper and access checks */
+	double stat_wt;
+	long resolve_count; /* zend_resolve_path calls, include_path resolution */
+	double resolve_wt;
+	HashTable *stat_paths; /* path => probe count, bounded to TIDEWAYS_MAX_STAT_PATHS */
+	HashTable *resolve_paths; /* include path filename => resolution count, same bound */
 	double compile_wt;
 	uint64 cpu_start;
 } hp_global_t;
 
-#ifdef PHP_TIDEWAYS_HAVE_CURL
-#if PHP_VERSION_ID > 50399
-typedef struct hp_curl_t {
-	struct {
-		char str[CURL_ERROR_SIZE + 1];
-		int  no;
-	} err;
+typedef long (*tw_trace_callback)(char *symbol, void **args, int args_len, zval *object TSRMLS_DC);
+typedef void (*tw_trace_end_callback)(long span_id, void **args, int args_len, zval *object TSRMLS_DC);
 
-	void *free;
+typedef struct tw_builtin_trace_callback {
+	tw_trace_callback cb;
+	tw_trace_end_callback end;
+	uint32 pack;
+} tw_builtin_trace_callback;
+
+typedef struct tw_callback_pack {
+	const char *name;
+	uint32 packs;
+} tw_callback_pack;
+
+static const tw_callback_pack tw_callback_packs[] = {
+	{"php", TW_PACK_PHP},
+	{"http", TW_PACK_HTTP},
+	{"sql", TW_PACK_SQL},
+	{"cache", TW_PACK_CACHE},
+	{"queue", TW_PACK_QUEUE},
+	{"mongo", TW_PACK_MONGO},
+	{"twig", TW_PACK_TWIG},
+	{"smarty", TW_PACK_SMARTY},
+	{"symfony", TW_PACK_SYMFONY},
+	{"doctrine", TW_PACK_DOCTRINE},
+	{"laravel", TW_PACK_LARAVEL},
+	{"magento", TW_PACK_MAGENTO},
+	{"shopware", TW_PACK_SHOPWARE},
+	{"zend", TW_PACK_ZEND},
+	{"wordpress", TW_PACK_WORDPRESS},
+	{"oxid", TW_PACK_OXID},
+	{"drupal", TW_PACK_DRUPAL},
+	{"all", TW_PACK_ALL},
+	{NULL, 0}
+};
 
-	struct {
-		char *str;
-		size_t str_len;
-	} hdr;
+/* Framework packs enabled by tideways.framework, matched by prefix */
+static const tw_callback_pack tw_framework_packs[] = {
+	{"symfony", TW_PACK_SYMFONY | TW_PACK_DOCTRINE | TW_PACK_TWIG},
+	{"silex", TW_PACK_SYMFONY | TW_PACK_DOCTRINE | TW_PACK_TWIG},
+	{"laravel", TW_PACK_LARAVEL | TW_PACK_SYMFONY},
+	{"shopware", TW_PACK_SHOPWARE | TW_PACK_ZEND | TW_PACK_SMARTY | TW_PACK_DOCTRINE | TW_PACK_SYMFONY},
+	{"magento", TW_PACK_MAGENTO | TW_PACK_ZEND},
+	{"oxid", TW_PACK_OXID | TW_PACK_SMARTY},
+	{"wordpress", TW_PACK_WORDPRESS},
+	{"zend", TW_PACK_ZEND},
+	{"drupal", TW_PACK_DRUPAL | TW_PACK_SYMFONY | TW_PACK_TWIG},
+	{NULL, 0}
+};
 
-	void ***thread_ctx;
-	CURL *cp;
-} hp_curl_t;
-#endif
-#endif
+/* Metric keys of the error kinds, counted per edge and on the app span */
+static const char *tw_error_kind_keys[TW_ERROR_KINDS] = {"ee", "ew", "en", "ed", "es"};
 
-typedef long (*tw_trace_callback)(char *symbol, void **args, int args_len, zval *object TSRMLS_DC);
+static inline int hp_error_kind(int type)
+{
+	switch (type) {
+		case E_WARNING:
+		case E_CORE_WARNING:
+		case E_COMPILE_WARNING:
+		case E_USER_WARNING:
+			return 1;
+		case E_NOTICE:
+		case E_USER_NOTICE:
+			return 2;
+		case E_DEPRECATED:
+		case E_USER_DEPRECATED:
+			return 3;
+		case E_STRICT:
+			return 4;
+		default:
+			return 0;
+	}
+}
+
+/* Result of resolving a function against the registered watches. For user
+ * functions it is cached by op_array address, so the class hierarchy is only
+ * walked on the first call. The address and not op_array.reserved is the key,
+ * inherited methods are struct copies of the parent's op_array. */
+typedef struct tw_resolved_watch {
+	tw_trace_callback cb;
+	tw_trace_end_callback end;
+	tw_watch_spec *spec;
+	char *name; /* registered name, if resolved through a parent class or interface */
+} tw_resolved_watch;
+
+/* Glob pattern registered with tideways_span_watch(), e.g. "App\\*::find*" */
+typedef struct tw_watch_pattern {
+	char *pattern; /* lowercased, matching is case-insensitive like PHP symbols */
+	tw_trace_callback cb;
+	tw_watch_spec *spec;
+} tw_watch_pattern;
+
+static void hp_register_request_trace_callback(char *function_name, int len, tw_trace_callback cb TSRMLS_DC);
+static void hp_register_builtin_trace_callback(char *function_name, int len, tw_trace_callback cb, tw_trace_end_callback end, uint32 pack TSRMLS_DC);
 
 /**
  * ***********************
  * GLOBAL STATIC VARIABLES
  * ***********************
  */
-/* Tideways global state */
-static hp_global_t       hp_globals;
+/* Tideways per-thread state, see hp_globals */
+typedef hp_global_t zend_tideways_globals;
+ZEND_DECLARE_MODULE_GLOBALS(tideways)
+
+#ifdef ZTS
+/* needs tsrm_ls in scope, pass it along with TSRMLS_DC */
+#define hp_globals (*((hp_global_t *) (*((void ***) tsrm_ls))[TSRM_UNSHUFFLE_RSRC_ID(tideways_globals_id)]))
+#else
+#define hp_globals tideways_globals
+#endif
+
+/* Process wide state, built in MINIT and only read by requests */
+static double tw_timebase_factor;
+static HashTable *tw_builtin_trace_callbacks; /* persistent built-in trace callbacks */
+static uint32 tw_builtin_packs; /* packs registered in tw_builtin_trace_callbacks */
+static HashTable *tw_file_watch_specs; /* persistent, loaded from tideways.span_watch_file */
 
 #if PHP_VERSION_ID < 50500
 /* Pointer to the original execute function */
@@ -256,10 +481,19 @@ static zend_op_array * (*_zend_compile_file) (zend_file_handle *file_handle,
 /* Pointer to the original compile string function (used by eval) */
 static zend_op_array * (*_zend_compile_string) (zval *source_string, char *filename TSRMLS_DC);
 
+/* Pointer to the original include path resolver */
+static char * (*_zend_resolve_path) (const char *filename, int filename_len TSRMLS_DC);
+
 /* error callback replacement functions */
 void (*tideways_original_error_cb)(int type, const char *error_filename, const uint error_lineno, const char *format, va_list args);
 void tideways_error_cb(int type, const char *error_filename, const uint error_lineno, const char *format, va_list args);
 
+/* exception hook and ZEND_CATCH handler replacements */
+static void (*tideways_original_throw_exception_hook)(zval *ex TSRMLS_DC);
+static void tideways_throw_exception_hook(zval *exception TSRMLS_DC);
+static user_opcode_handler_t tideways_original_catch_handler;
+static int tideways_catch_handler(ZEND_OPCODE_HANDLER_ARGS);
+
 /* Bloom filter for function names to be ignored */
 #define INDEX_2_BYTE(index)  (index >> 3)
 #define INDEX_2_BIT(index)   (1 << (index & 0x7));
@@ -273,25 +507,27 @@ void tideways_error_cb(int type, const char *error_filename, const uint error_li
 static void hp_register_constants(INIT_FUNC_ARGS);
 
 static void hp_begin(long tideways_flags TSRMLS_DC);
+static void hp_install_hooks(uint32 flags TSRMLS_DC);
+static void hp_remove_hooks(TSRMLS_D);
 static void hp_stop(TSRMLS_D);
 static void hp_end(TSRMLS_D);
 
 static uint64 cycle_timer();
 
-static void hp_free_the_free_list();
-static hp_entry_t *hp_fast_alloc_hprof_entry();
-static void hp_fast_free_hprof_entry(hp_entry_t *p);
+static void hp_free_the_free_list(TSRMLS_D);
+static hp_entry_t *hp_fast_alloc_hprof_entry(TSRMLS_D);
+static void hp_fast_free_hprof_entry(hp_entry_t *p TSRMLS_DC);
 static inline uint8 hp_inline_hash(char * str);
 static double get_timebase_factor();
 static long get_us_interval(struct timeval *start, struct timeval *end);
 static inline double get_us_from_tsc(uint64 count);
 
-static void hp_parse_options_from_arg(zval *args);
-static void hp_clean_profiler_options_state();
+static void hp_parse_options_from_arg(zval *args TSRMLS_DC);
+static void hp_clean_profiler_options_state(TSRMLS_D);
 
-static void hp_exception_function_clear();
-static void hp_transaction_function_clear();
-static void hp_transaction_name_clear();
+static void hp_exception_function_clear(TSRMLS_D);
+static void hp_transaction_function_clear(TSRMLS_D);
+static void hp_transaction_name_clear(TSRMLS_D);
 
 static inline zval  *hp_zval_at_key(char  *key, zval  *values);
 static inline char **hp_strings_in_zval(zval  *values);
@@ -301,9 +537,35 @@ static inline long hp_zval_to_long(zval *z);
 static inline hp_string *hp_zval_to_string(zval *z);
 static inline zval *hp_string_to_zval(hp_string *str);
 static inline void hp_string_clean(hp_string *str);
-static char *hp_get_file_summary(char *filename, int filename_len TSRMLS_DC);
+static const char *hp_get_file_summary(char *filename, int filename_len TSRMLS_DC);
 static char *hp_get_base_filename(char *filename);
 
+static void hp_init_builtin_trace_callbacks(TSRMLS_D);
+static void hp_resolved_watch_dtor(void *data);
+static void hp_clean_resolved_watches(TSRMLS_D);
+static void free_tw_watch_pattern(void *data);
+static uint32 hp_resolve_callback_packs(const char *packs, const char *framework);
+static void hp_free_builtin_trace_callbacks(TSRMLS_D);
+static void hp_load_watch_file(const char *filename TSRMLS_DC);
+static void hp_free_watch_file(TSRMLS_D);
+static void hp_read_incoming_trace(TSRMLS_D);
+static void hp_init_trace_id(TSRMLS_D);
+static HashTable *hp_compile_tracing_hosts(const char *hosts);
+static int hp_tracing_host_allowed(const char *url TSRMLS_DC);
+static void hp_finish_curl_multi_transfers(TSRMLS_D);
+static void hp_clean_curl_traces(TSRMLS_D);
+static void hp_free_curl_restored(TSRMLS_D);
+static void hp_init_http_stream_wrapper(TSRMLS_D);
+static void hp_finish_http_streams(TSRMLS_D);
+static void hp_free_http_stream_wrapper(TSRMLS_D);
+static void hp_init_file_io(TSRMLS_D);
+static void hp_annotate_file_io(TSRMLS_D);
+static void hp_clean_file_io(TSRMLS_D);
+static void hp_clean_compile_top(TSRMLS_D);
+static void hp_clean_autoload_top(TSRMLS_D);
+static void hp_init_plain_files_wrapper(uint32 flags TSRMLS_DC);
+static void hp_free_plain_files_wrapper(TSRMLS_D);
+
 static inline hp_function_map *hp_function_map_create(char **names);
 static inline void hp_function_map_clear(hp_function_map *map);
 static inline int hp_function_map_exists(hp_function_map *map, uint8 hash_code, char *curr_func);
@@ -367,6 +629,9 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_tideways_span_callback, 0, 0, 0)
 	ZEND_ARG_INFO(0, callback)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO(arginfo_tideways_trace_id, 0)
+ZEND_END_ARG_INFO()
+
 /* }}} */
 
 /**
@@ -391,10 +656,14 @@ zend_function_entry tideways_functions[] = {
 	PHP_FE(tideways_span_annotate, arginfo_tideways_span_annotate)
 	PHP_FE(tideways_span_watch, arginfo_tideways_span_watch)
 	PHP_FE(tideways_span_callback, arginfo_tideways_span_callback)
+	PHP_FE(tideways_trace_id, arginfo_tideways_trace_id)
 	{NULL, NULL, NULL}
 };
 
 /* Callback functions for the Tideways extension */
+static PHP_GINIT_FUNCTION(tideways);
+static PHP_GSHUTDOWN_FUNCTION(tideways);
+
 zend_module_entry tideways_module_entry = {
 #if ZEND_MODULE_API_NO >= 20010901
 	STANDARD_MODULE_HEADER,
@@ -409,7 +678,11 @@ zend_module_entry tideways_module_entry = {
 #if ZEND_MODULE_API_NO >= 20010901
 	TIDEWAYS_VERSION,
 #endif
-	STANDARD_MODULE_PROPERTIES
+	PHP_MODULE_GLOBALS(tideways),      /* Per-thread globals, hp_globals */
+	PHP_GINIT(tideways),               /* Globals constructor */
+	PHP_GSHUTDOWN(tideways),           /* Globals destructor */
+	NULL,
+	STANDARD_MODULE_PROPERTIES_EX
 };
 
 PHP_INI_BEGIN()
@@ -427,6 +700,10 @@ PHP_INI_ENTRY("tideways.auto_prepend_library", "1", PHP_INI_ALL, NULL)
 PHP_INI_ENTRY("tideways.collect", "tracing", PHP_INI_ALL, NULL)
 PHP_INI_ENTRY("tideways.monitor", "basic", PHP_INI_ALL, NULL)
 PHP_INI_ENTRY("tideways.distributed_tracing_hosts", "127.0.0.1", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("tideways.span_watch_file", "", PHP_INI_SYSTEM, NULL)
+PHP_INI_ENTRY("tideways.callback_packs", "", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("tideways.url_collapse_numeric", "0", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("tideways.file_io_prefixes", "", PHP_INI_ALL, NULL)
 
 PHP_INI_END()
 
@@ -461,7 +738,13 @@ PHP_FUNCTION(tideways_enable)
 		return;
 	}
 
-	hp_parse_options_from_arg(optional_array);
+	/* spl_autoload_call() is a builtin, autoloads are never seen without them */
+	if ((tideways_flags & TIDEWAYS_FLAGS_AUTOLOAD) && (tideways_flags & TIDEWAYS_FLAGS_NO_BUILTINS)) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "TIDEWAYS_FLAGS_AUTOLOAD cannot be combined with TIDEWAYS_FLAGS_NO_BUILTINS and is ignored");
+		tideways_flags &= ~TIDEWAYS_FLAGS_AUTOLOAD;
+	}
+
+	hp_parse_options_from_arg(optional_array TSRMLS_CC);
 
 	hp_begin(tideways_flags TSRMLS_CC);
 }
@@ -484,6 +767,17 @@ PHP_FUNCTION(tideways_disable)
 	RETURN_ZVAL(hp_globals.stats_count, 1, 0);
 }
 
+/**
+ * Trace id of the current request, either taken from the incoming
+ * X-Tideways-Trace header or generated in tideways_enable().
+ */
+PHP_FUNCTION(tideways_trace_id)
+{
+	if (hp_globals.trace_id[0] != '\0') {
+		RETURN_STRING(hp_globals.trace_id, 1);
+	}
+}
+
 PHP_FUNCTION(tideways_transaction_name)
 {
 	if (hp_globals.transaction_name) {
@@ -526,7 +820,7 @@ PHP_FUNCTION(tideways_last_fatal_error)
 	}
 }
 
-long tw_span_create(char *category, size_t category_len)
+long tw_span_create(char *category, size_t category_len TSRMLS_DC)
 {
 	zval *span, *starts, *stops, *annotations;
 	int idx;
@@ -562,7 +856,7 @@ long tw_span_create(char *category, size_t category_len)
 	return idx;
 }
 
-void tw_span_timer_start(long spanId)
+void tw_span_timer_start(long spanId TSRMLS_DC)
 {
 	zval **span, **starts;
 	double wt;
@@ -579,7 +873,7 @@ void tw_span_timer_start(long spanId)
 	add_next_index_long(*starts, wt);
 }
 
-void tw_span_record_duration(long spanId, double start, double end)
+void tw_span_record_duration(long spanId, double start, double end TSRMLS_DC)
 {
 	zval **span, **timer;
 
@@ -600,7 +894,7 @@ void tw_span_record_duration(long spanId, double start, double end)
 	add_next_index_long(*timer, start);
 }
 
-void tw_span_timer_stop(long spanId)
+void tw_span_timer_stop(long spanId TSRMLS_DC)
 {
 	zval **span, **stops;
 	double wt;
@@ -646,7 +940,7 @@ void tw_span_annotate(long spanId, zval *annotations TSRMLS_DC)
 	zend_hash_merge(Z_ARRVAL_PP(span_annotations), Z_ARRVAL_P(annotations), (copy_ctor_func_t) zval_add_ref, NULL, sizeof(zval *), 1);
 }
 
-void tw_span_annotate_long(long spanId, char *key, long value)
+void tw_span_annotate_long(long spanId, char *key, long value TSRMLS_DC)
 {
 	zval **span, **span_annotations, *annotation_value, *span_annotations_ptr;
 
@@ -668,7 +962,7 @@ void tw_span_annotate_long(long spanId, char *key, long value)
 	add_assoc_zval_ex(*span_annotations, key, strlen(key)+1, annotation_value);
 }
 
-void tw_span_annotate_string(long spanId, char *key, char *value, int copy)
+void tw_span_annotate_string(long spanId, char *key, char *value, int copy TSRMLS_DC)
 {
 	zval **span, **span_annotations, *span_annotations_ptr;
 	int len;
@@ -694,6 +988,123 @@ void tw_span_annotate_string(long spanId, char *key, char *value, int copy)
 	add_assoc_stringl_ex(*span_annotations, key, strlen(key)+1, value, len, copy);
 }
 
+/**
+ * Spans for high frequency calls (cache commands) sum up their calls instead
+ * of recording a timer each, so thousands of calls neither hit the span
+ * limit nor grow the timer lists. tw_span_flush_aggregates() writes the
+ * totals into the span as a single timer and annotations.
+ */
+typedef struct tw_span_aggregate {
+	double start;
+	double wt;
+	long calls;
+	long keys;
+	long bytes;
+	long hits;
+	long misses;
+} tw_span_aggregate;
+
+long tw_span_aggregate_create(char *category, size_t category_len, char *title TSRMLS_DC)
+{
+	tw_span_aggregate aggregate;
+	long idx, *idx_ptr;
+
+	if (zend_hash_find(hp_globals.span_cache, title, strlen(title)+1, (void **)&idx_ptr) == SUCCESS) {
+		return *idx_ptr;
+	}
+
+	idx = tw_span_create(category, category_len TSRMLS_CC);
+
+	if (idx < 0) {
+		return idx;
+	}
+
+	tw_span_annotate_string(idx, "title", title, 1 TSRMLS_CC);
+	zend_hash_update(hp_globals.span_cache, title, strlen(title)+1, &idx, sizeof(long), NULL);
+
+	if (hp_globals.span_aggregates == NULL) {
+		ALLOC_HASHTABLE(hp_globals.span_aggregates);
+		zend_hash_init(hp_globals.span_aggregates, 16, NULL, NULL, 0);
+	}
+
+	memset(&aggregate, 0, sizeof(tw_span_aggregate));
+	zend_hash_index_update(hp_globals.span_aggregates, idx, &aggregate, sizeof(tw_span_aggregate), NULL);
+
+	return idx;
+}
+
+static tw_span_aggregate *tw_span_aggregate_find(long spanId TSRMLS_DC)
+{
+	tw_span_aggregate *aggregate;
+
+	if (hp_globals.span_aggregates == NULL || zend_hash_index_find(hp_globals.span_aggregates, spanId, (void **)&aggregate) == FAILURE) {
+		return NULL;
+	}
+
+	return aggregate;
+}
+
+static void tw_span_aggregate_duration(tw_span_aggregate *aggregate, double start, double end)
+{
+	if (aggregate->calls == 0) {
+		aggregate->start = start;
+	}
+
+	aggregate->calls++;
+	aggregate->wt += end - start;
+}
+
+static void tw_span_reset_timer(zval *span, char *key, int key_len, double value)
+{
+	zval **timer;
+
+	if (zend_hash_find(Z_ARRVAL_P(span), key, key_len, (void **) &timer) == SUCCESS) {
+		zend_hash_clean(Z_ARRVAL_PP(timer));
+		add_next_index_long(*timer, value);
+	}
+}
+
+void tw_span_flush_aggregates(TSRMLS_D)
+{
+	tw_span_aggregate *aggregate;
+	HashPosition pos;
+	zval **span;
+	ulong idx;
+
+	if (hp_globals.span_aggregates == NULL) {
+		return;
+	}
+
+	for (zend_hash_internal_pointer_reset_ex(hp_globals.span_aggregates, &pos);
+		zend_hash_get_current_data_ex(hp_globals.span_aggregates, (void **)&aggregate, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(hp_globals.span_aggregates, &pos)) {
+		zend_hash_get_current_key_ex(hp_globals.span_aggregates, NULL, NULL, &idx, 0, &pos);
+
+		if (aggregate->calls == 0 || zend_hash_index_find(Z_ARRVAL_P(hp_globals.spans), idx, (void **) &span) == FAILURE) {
+			continue;
+		}
+
+		tw_span_reset_timer(*span, "b", sizeof("b"), aggregate->start);
+		tw_span_reset_timer(*span, "e", sizeof("e"), aggregate->start + aggregate->wt);
+
+		tw_span_annotate_long(idx, "calls", aggregate->calls TSRMLS_CC);
+		tw_span_annotate_long(idx, "wt", (long)aggregate->wt TSRMLS_CC);
+
+		if (aggregate->keys > 0) {
+			tw_span_annotate_long(idx, "keys", aggregate->keys TSRMLS_CC);
+		}
+
+		if (aggregate->bytes > 0) {
+			tw_span_annotate_long(idx, "bytes", aggregate->bytes TSRMLS_CC);
+		}
+
+		if (aggregate->hits > 0 || aggregate->misses > 0) {
+			tw_span_annotate_long(idx, "hits", aggregate->hits TSRMLS_CC);
+			tw_span_annotate_long(idx, "misses", aggregate->misses TSRMLS_CC);
+		}
+	}
+}
+
 PHP_FUNCTION(tideways_span_create)
 {
 	char *category = NULL;
@@ -707,12 +1118,14 @@ PHP_FUNCTION(tideways_span_create)
 		return;
 	}
 
-	RETURN_LONG(tw_span_create(category, category_len));
+	RETURN_LONG(tw_span_create(category, category_len TSRMLS_CC));
 }
 
 PHP_FUNCTION(tideways_get_spans)
 {
 	if (hp_globals.spans) {
+		tw_span_flush_aggregates(TSRMLS_C);
+
 		RETURN_ZVAL(hp_globals.spans, 1, 0);
 	}
 }
@@ -729,7 +1142,7 @@ PHP_FUNCTION(tideways_span_timer_start)
 		return;
 	}
 
-	tw_span_timer_start(spanId);
+	tw_span_timer_start(spanId TSRMLS_CC);
 }
 
 PHP_FUNCTION(tideways_span_timer_stop)
@@ -744,7 +1157,7 @@ PHP_FUNCTION(tideways_span_timer_stop)
 		return;
 	}
 
-	tw_span_timer_stop(spanId);
+	tw_span_timer_stop(spanId TSRMLS_CC);
 }
 
 PHP_FUNCTION(tideways_span_annotate)
@@ -765,6 +1178,24 @@ PHP_FUNCTION(tideways_sql_minify)
 	RETURN_EMPTY_STRING();
 }
 
+/**
+ * Per-thread globals constructor, hp_globals of the new thread are zeroed.
+ */
+static PHP_GINIT_FUNCTION(tideways)
+{
+	memset(tideways_globals, 0, sizeof(zend_tideways_globals));
+
+	zend_llist_init(&tideways_globals->watch_patterns, sizeof(tw_watch_pattern), free_tw_watch_pattern, 0);
+}
+
+static PHP_GSHUTDOWN_FUNCTION(tideways)
+{
+	/* free any remaining items in the free list */
+	hp_free_the_free_list(TSRMLS_C);
+
+	zend_llist_destroy(&tideways_globals->watch_patterns);
+}
+
 /**
  * Module init callback.
  *
@@ -772,30 +1203,30 @@ PHP_FUNCTION(tideways_sql_minify)
  */
 PHP_MINIT_FUNCTION(tideways)
 {
-	int i;
-
 	REGISTER_INI_ENTRIES();
 
 	hp_register_constants(INIT_FUNC_ARGS_PASSTHRU);
 
 	/* Get the number of available logical CPUs. */
-	hp_globals.timebase_factor = get_timebase_factor();
+	tw_timebase_factor = get_timebase_factor();
 
-	hp_globals.stats_count = NULL;
-	hp_globals.spans = NULL;
-	hp_globals.trace_callbacks = NULL;
-	hp_globals.trace_watch_callbacks = NULL;
-	hp_globals.span_cache = NULL;
+	tw_file_watch_specs = NULL;
+	tw_builtin_trace_callbacks = NULL;
 
-	/* no free hp_entry_t structures to start with */
-	hp_globals.entry_free_list = NULL;
+	tw_builtin_packs = hp_resolve_callback_packs(INI_STR("tideways.callback_packs"), INI_STR("tideways.framework"));
 
-	for (i = 0; i < 256; i++) {
-		hp_globals.func_hash_counters[i] = 0;
-	}
+	hp_init_builtin_trace_callbacks(TSRMLS_C);
+	hp_init_http_stream_wrapper(TSRMLS_C);
+
+	tideways_original_catch_handler = zend_get_user_opcode_handler(ZEND_CATCH);
+	zend_set_user_opcode_handler(ZEND_CATCH, tideways_catch_handler);
 
-	hp_transaction_function_clear();
-	hp_exception_function_clear();
+	hp_load_watch_file(INI_STR("tideways.span_watch_file") TSRMLS_CC);
+
+#ifdef ZTS
+	/* FILE_IO is a per request flag, its proxies check it in their thread */
+	hp_install_hooks(TIDEWAYS_FLAGS_FILE_IO TSRMLS_CC);
+#endif
 
 #if defined(DEBUG)
 	/* To make it random number generator repeatable to ease testing. */
@@ -809,26 +1240,185 @@ PHP_MINIT_FUNCTION(tideways)
  */
 PHP_MSHUTDOWN_FUNCTION(tideways)
 {
-	/* free any remaining items in the free list */
-	hp_free_the_free_list();
+#ifdef ZTS
+	hp_remove_hooks(TSRMLS_C);
+#endif
+
+	hp_free_watch_file(TSRMLS_C);
+	hp_free_builtin_trace_callbacks(TSRMLS_C);
+	hp_free_http_stream_wrapper(TSRMLS_C);
+
+	zend_set_user_opcode_handler(ZEND_CATCH, tideways_original_catch_handler);
 
 	UNREGISTER_INI_ENTRIES();
 
 	return SUCCESS;
 }
 
-long tw_trace_callback_record_with_cache(char *category, int category_len, char *summary, int summary_len, int copy)
+long tw_trace_callback_record_with_cache(char *category, int category_len, char *summary, int summary_len, int copy TSRMLS_DC)
 {
 	long idx, *idx_ptr;
 
 	if (zend_hash_find(hp_globals.span_cache, summary, strlen(summary)+1, (void **)&idx_ptr) == SUCCESS) {
 		idx = *idx_ptr;
 	} else {
-		idx = tw_span_create(category, category_len);
+		idx = tw_span_create(category, category_len TSRMLS_CC);
 		zend_hash_update(hp_globals.span_cache, summary, strlen(summary)+1, &idx, sizeof(long), NULL);
 	}
 
-	tw_span_annotate_string(idx, "title", summary, copy);
+	tw_span_annotate_string(idx, "title", summary, copy TSRMLS_CC);
+
+	return idx;
+}
+
+/**
+ * State kept per object handle has to go when the object is freed, the
+ * next object gets the same handle. The free_storage of such objects is
+ * swapped in their store bucket for hp_object_free_storage(), which drops
+ * the state and calls the original, hp_clean_object_hooks() puts the
+ * original back on objects still alive when the profiler state is cleaned.
+ */
+typedef struct tw_object_hook {
+	zend_object_handle handle;
+	zend_objects_free_object_storage_t free_storage;
+} tw_object_hook;
+
+static void hp_object_free_storage(void *object TSRMLS_DC)
+{
+	zend_objects_free_object_storage_t free_storage;
+	tw_object_hook *hook;
+
+	/*
+	 * Every object pointing here has its hook in the table until
+	 * hp_clean_object_hooks() restored it. Without the hook the original
+	 * free_storage is unknown, leaking the object is safer than guessing.
+	 */
+	if (hp_globals.object_hooks == NULL || zend_hash_index_find(hp_globals.object_hooks, (zend_uintptr_t)object, (void **)&hook) == FAILURE) {
+		assert(0);
+		return;
+	}
+
+	free_storage = hook->free_storage;
+
+	if (hp_globals.mongo_cursors != NULL) {
+		zend_hash_index_del(hp_globals.mongo_cursors, hook->handle);
+	}
+
+	if (hp_globals.object_spans != NULL) {
+		zend_hash_index_del(hp_globals.object_spans, hook->handle);
+	}
+
+	zend_hash_index_del(hp_globals.object_hooks, (zend_uintptr_t)object);
+
+	if (free_storage != NULL) {
+		free_storage(object TSRMLS_CC);
+	}
+}
+
+static void hp_object_hook(zval *object TSRMLS_DC)
+{
+	struct _store_object *obj = &EG(objects_store).object_buckets[Z_OBJ_HANDLE_P(object)].bucket.obj;
+	tw_object_hook hook;
+
+	if (obj->free_storage == hp_object_free_storage) {
+		return;
+	}
+
+	if (hp_globals.object_hooks == NULL) {
+		ALLOC_HASHTABLE(hp_globals.object_hooks);
+		zend_hash_init(hp_globals.object_hooks, 32, NULL, NULL, 0);
+	}
+
+	hook.handle = Z_OBJ_HANDLE_P(object);
+	hook.free_storage = obj->free_storage;
+
+	zend_hash_index_update(hp_globals.object_hooks, (zend_uintptr_t)obj->object, &hook, sizeof(tw_object_hook), NULL);
+	obj->free_storage = hp_object_free_storage;
+}
+
+static int hp_object_unhook(void *data TSRMLS_DC, int num_args, va_list args, zend_hash_key *hash_key)
+{
+	tw_object_hook *hook = (tw_object_hook *)data;
+	zend_object_store_bucket *bucket;
+
+	if (hook->handle < EG(objects_store).top) {
+		bucket = &EG(objects_store).object_buckets[hook->handle];
+
+		if (bucket->valid && (zend_uintptr_t)bucket->bucket.obj.object == hash_key->h && bucket->bucket.obj.free_storage == hp_object_free_storage) {
+			bucket->bucket.obj.free_storage = hook->free_storage;
+		}
+	}
+
+	return ZEND_HASH_APPLY_REMOVE;
+}
+
+static void hp_clean_object_hooks(TSRMLS_D)
+{
+	if (hp_globals.object_hooks == NULL) {
+		return;
+	}
+
+	if (EG(objects_store).object_buckets != NULL) {
+		zend_hash_apply_with_arguments(hp_globals.object_hooks TSRMLS_CC, hp_object_unhook, 0);
+	}
+
+	zend_hash_destroy(hp_globals.object_hooks);
+	FREE_HASHTABLE(hp_globals.object_hooks);
+	hp_globals.object_hooks = NULL;
+}
+
+static long hp_class_span_find(zend_class_entry *ce TSRMLS_DC)
+{
+	long *idx_ptr;
+
+	if (hp_globals.class_spans == NULL || zend_hash_index_find(hp_globals.class_spans, (zend_uintptr_t)ce, (void **)&idx_ptr) == FAILURE) {
+		return -1;
+	}
+
+	return *idx_ptr;
+}
+
+static long hp_class_span_remember(zend_class_entry *ce, long idx TSRMLS_DC)
+{
+	if (idx < 0) {
+		return idx;
+	}
+
+	if (hp_globals.class_spans == NULL) {
+		ALLOC_HASHTABLE(hp_globals.class_spans);
+		zend_hash_init(hp_globals.class_spans, 32, NULL, NULL, 0);
+	}
+
+	zend_hash_index_update(hp_globals.class_spans, (zend_uintptr_t)ce, &idx, sizeof(long), NULL);
+
+	return idx;
+}
+
+static long hp_object_span_find(zval *object TSRMLS_DC)
+{
+	long *idx_ptr;
+
+	if (hp_globals.object_spans == NULL || zend_hash_index_find(hp_globals.object_spans, Z_OBJ_HANDLE_P(object), (void **)&idx_ptr) == FAILURE) {
+		return -1;
+	}
+
+	return *idx_ptr;
+}
+
+/* Forgotten when the object is freed, before its handle is reused */
+static long hp_object_span_remember(zval *object, long idx TSRMLS_DC)
+{
+	if (idx < 0) {
+		return idx;
+	}
+
+	if (hp_globals.object_spans == NULL) {
+		ALLOC_HASHTABLE(hp_globals.object_spans);
+		zend_hash_init(hp_globals.object_spans, 32, NULL, NULL, 0);
+	}
+
+	zend_hash_index_update(hp_globals.object_spans, Z_OBJ_HANDLE_P(object), &idx, sizeof(long), NULL);
+	hp_object_hook(object TSRMLS_CC);
 
 	return idx;
 }
@@ -837,8 +1427,8 @@ long tw_trace_callback_php_call(char *symbol, void **args, int args_len, zval *o
 {
 	long idx;
 
-	idx = tw_span_create("php", 3);
-	tw_span_annotate_string(idx, "title", symbol, 1);
+	idx = tw_span_create("php", 3 TSRMLS_CC);
+	tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
 
 	return idx;
 }
@@ -916,90 +1506,262 @@ long tw_trace_callback_watch(char *symbol, void **args, int args_len, zval *obje
 	return -1;
 }
 
-long tw_trace_callback_mongo_cursor_io(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+static zval *tw_watch_extract(tw_watch_extractor *extractor, void **args, int args_len, zval *object TSRMLS_DC)
 {
-	long idx = -1;
-	zval fname, *retval_ptr, **data;
-
-	idx = tw_span_create("mongo", 5);
-	tw_span_annotate_string(idx, "title", symbol, 1);
+	switch (extractor->type) {
+		case TW_WATCH_EXTRACT_ARGUMENT:
+			if (extractor->argument >= args_len) {
+				return NULL;
+			}
 
-	ZVAL_STRING(&fname, "info", 0);
+			return *(args-args_len+extractor->argument);
 
-	if (SUCCESS == call_user_function_ex(EG(function_table), &object, &fname, &retval_ptr, 0, NULL, 1, NULL TSRMLS_CC)) {
-		if (Z_TYPE_P(retval_ptr) == IS_ARRAY) {
-			if (zend_hash_find(Z_ARRVAL_P(retval_ptr), "ns", sizeof("ns"), (void**)&data) == SUCCESS) {
-				tw_span_annotate_string(idx, "collection", Z_STRVAL_PP(data), 1);
+		case TW_WATCH_EXTRACT_PROPERTY:
+			if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
+				return NULL;
 			}
-		}
 
-		zval_ptr_dtor(&retval_ptr);
+			return zend_read_property(Z_OBJCE_P(object), object, extractor->property, extractor->property_len, 1 TSRMLS_CC);
 	}
 
-	return idx;
+	return NULL;
 }
 
-long tw_trace_callback_mongo_cursor_next(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+static void tw_watch_annotate_zval(long idx, char *key, zval *value TSRMLS_DC)
 {
-	long idx = -1;
-	zend_class_entry *cursor_ce;
-	zval *queryRunProperty;
-	zval fname, *retval_ptr, **data;
+	zval tmp;
 
-	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
-		return idx;
+	if (value == NULL) {
+		return;
 	}
 
-	cursor_ce = Z_OBJCE_P(object);
-	queryRunProperty = zend_read_property(cursor_ce, object, "_tidewaysQueryRun", sizeof("_tidewaysQueryRun")-1, 1 TSRMLS_CC);
+	switch (Z_TYPE_P(value)) {
+		case IS_STRING:
+			tw_span_annotate_string(idx, key, Z_STRVAL_P(value), 1 TSRMLS_CC);
+			break;
 
-	if (queryRunProperty != NULL && Z_TYPE_P(queryRunProperty) != IS_NULL) {
-		return idx;
+		case IS_LONG:
+		case IS_DOUBLE:
+		case IS_BOOL:
+			tmp = *value;
+			zval_copy_ctor(&tmp);
+			convert_to_string(&tmp);
+			tw_span_annotate_string(idx, key, Z_STRVAL(tmp), 1 TSRMLS_CC);
+			zval_dtor(&tmp);
+			break;
 	}
+}
 
-	zend_update_property_bool(cursor_ce, object, "_tidewaysQueryRun", sizeof("_tidewaysQueryRun") - 1, 1 TSRMLS_CC);
-
-	idx = tw_span_create("mongo", 5);
-	tw_span_annotate_string(idx, "title", symbol, 1);
+static long tw_watch_spec_record(tw_watch_spec *spec, char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	long idx;
+	int i;
 
-	ZVAL_STRING(&fname, "info", 0);
+	idx = tw_span_create(spec->category, spec->category_len TSRMLS_CC);
 
-	if (SUCCESS == call_user_function_ex(EG(function_table), &object, &fname, &retval_ptr, 0, NULL, 1, NULL TSRMLS_CC)) {
-		if (Z_TYPE_P(retval_ptr) == IS_ARRAY) {
-			if (zend_hash_find(Z_ARRVAL_P(retval_ptr), "ns", sizeof("ns"), (void**)&data) == SUCCESS) {
-				tw_span_annotate_string(idx, "collection", Z_STRVAL_PP(data), 1);
-			}
-		}
+	if (spec->title.type == TW_WATCH_EXTRACT_NONE) {
+		tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
+	} else {
+		tw_watch_annotate_zval(idx, "title", tw_watch_extract(&spec->title, args, args_len, object TSRMLS_CC) TSRMLS_CC);
+	}
 
-		zval_ptr_dtor(&retval_ptr);
+	for (i = 0; i < spec->annotations_len; i++) {
+		tw_watch_annotate_zval(
+			idx,
+			spec->annotations[i].key,
+			tw_watch_extract(&spec->annotations[i].extractor, args, args_len, object TSRMLS_CC) TSRMLS_CC
+		);
 	}
 
 	return idx;
 }
 
-long tw_trace_callback_mongo_collection(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+long tw_trace_callback_watch_spec(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
 {
-	long idx = -1;
-	zval fname, *retval_ptr;
+	tw_watch_spec **temp;
 
-	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
-		return idx;
+	if (hp_globals.trace_watch_specs == NULL) {
+		return -1;
 	}
 
-	ZVAL_STRING(&fname, "getName", 0);
+	if (zend_hash_find(hp_globals.trace_watch_specs, symbol, strlen(symbol)+1, (void **)&temp) == FAILURE) {
+		return -1;
+	}
 
-	idx = tw_span_create("mongo", 5);
-	tw_span_annotate_string(idx, "title", symbol, 1);
+	return tw_watch_spec_record(*temp, symbol, args, args_len, object TSRMLS_CC);
+}
 
-	if (SUCCESS == call_user_function_ex(EG(function_table), &object, &fname, &retval_ptr, 0, NULL, 1, NULL TSRMLS_CC)) {
-		if (Z_TYPE_P(retval_ptr) == IS_STRING) {
-			tw_span_annotate_string(idx, "collection", Z_STRVAL_P(retval_ptr), 1);
-		}
+/**
+ * Namespace and "already recorded" state of legacy Mongo cursors, keyed by
+ * object handle so cursors neither need a MongoCursor::info() call on every
+ * operation nor a marker property on the user's object. The state is
+ * dropped when the cursor is freed, see hp_object_hook().
+ */
+typedef struct tw_mongo_cursor {
+	char *ns;
+	int recorded;
+} tw_mongo_cursor;
 
-		zval_ptr_dtor(&retval_ptr);
-	}
+static void hp_free_mongo_cursor(void *data)
+{
+	tw_mongo_cursor *cursor = (tw_mongo_cursor *)data;
 
-	return idx;
+	if (cursor->ns) {
+		efree(cursor->ns);
+	}
+}
+
+static tw_mongo_cursor *hp_mongo_cursor(zval *object TSRMLS_DC)
+{
+	tw_mongo_cursor cursor, *found;
+	zval fname, *retval_ptr, **data;
+
+	if (hp_globals.mongo_cursors == NULL) {
+		ALLOC_HASHTABLE(hp_globals.mongo_cursors);
+		zend_hash_init(hp_globals.mongo_cursors, 8, NULL, hp_free_mongo_cursor, 0);
+	} else if (zend_hash_index_find(hp_globals.mongo_cursors, Z_OBJ_HANDLE_P(object), (void **)&found) == SUCCESS) {
+		return found;
+	}
+
+	cursor.ns = NULL;
+	cursor.recorded = 0;
+
+	ZVAL_STRING(&fname, "info", 0);
+
+	if (SUCCESS == call_user_function_ex(EG(function_table), &object, &fname, &retval_ptr, 0, NULL, 1, NULL TSRMLS_CC)) {
+		if (Z_TYPE_P(retval_ptr) == IS_ARRAY) {
+			if (zend_hash_find(Z_ARRVAL_P(retval_ptr), "ns", sizeof("ns"), (void**)&data) == SUCCESS && Z_TYPE_PP(data) == IS_STRING) {
+				cursor.ns = estrndup(Z_STRVAL_PP(data), Z_STRLEN_PP(data));
+			}
+		}
+
+		zval_ptr_dtor(&retval_ptr);
+	}
+
+	zend_hash_index_update(hp_globals.mongo_cursors, Z_OBJ_HANDLE_P(object), &cursor, sizeof(tw_mongo_cursor), (void **)&found);
+	hp_object_hook(object TSRMLS_CC);
+
+	return found;
+}
+
+long tw_trace_callback_mongo_cursor_io(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	tw_mongo_cursor *cursor;
+	long idx = -1;
+
+	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
+		return idx;
+	}
+
+	cursor = hp_mongo_cursor(object TSRMLS_CC);
+
+	idx = tw_span_create("mongo", 5 TSRMLS_CC);
+	tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
+
+	if (cursor->ns) {
+		tw_span_annotate_string(idx, "collection", cursor->ns, 1 TSRMLS_CC);
+	}
+
+	return idx;
+}
+
+long tw_trace_callback_mongo_cursor_next(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	tw_mongo_cursor *cursor;
+	long idx = -1;
+
+	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
+		return idx;
+	}
+
+	cursor = hp_mongo_cursor(object TSRMLS_CC);
+
+	if (cursor->recorded) {
+		return idx;
+	}
+
+	cursor->recorded = 1;
+
+	idx = tw_span_create("mongo", 5 TSRMLS_CC);
+	tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
+
+	if (cursor->ns) {
+		tw_span_annotate_string(idx, "collection", cursor->ns, 1 TSRMLS_CC);
+	}
+
+	return idx;
+}
+
+/**
+ * MongoDB\Driver\Manager::executeQuery/executeCommand/executeBulkWrite,
+ * aggregated into one span per namespace and operation. Commands only know
+ * their database, they are recorded as "db.$cmd".
+ */
+long tw_trace_callback_mongodb_manager(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	zval *ns;
+	char *key, *title;
+	int key_len, title_len;
+	long idx, *idx_ptr;
+
+	if (args_len < 1) {
+		return -1;
+	}
+
+	ns = *(args-args_len);
+
+	if (Z_TYPE_P(ns) != IS_STRING) {
+		return -1;
+	}
+
+	if (strcmp(symbol, "MongoDB\\Driver\\Manager::executeCommand") == 0) {
+		title_len = spprintf(&title, 0, "%s.$cmd", Z_STRVAL_P(ns));
+	} else {
+		title = estrndup(Z_STRVAL_P(ns), Z_STRLEN_P(ns));
+		title_len = Z_STRLEN_P(ns);
+	}
+
+	key_len = spprintf(&key, 0, "mongo %s %s", symbol, title);
+
+	if (zend_hash_find(hp_globals.span_cache, key, key_len+1, (void **)&idx_ptr) == SUCCESS) {
+		idx = *idx_ptr;
+	} else {
+		idx = tw_span_create("mongo", 5 TSRMLS_CC);
+		zend_hash_update(hp_globals.span_cache, key, key_len+1, &idx, sizeof(long), NULL);
+
+		tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
+		tw_span_annotate_string(idx, "collection", title, 1 TSRMLS_CC);
+	}
+
+	efree(key);
+	efree(title);
+
+	return idx;
+}
+
+long tw_trace_callback_mongo_collection(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	long idx = -1;
+	zval fname, *retval_ptr;
+
+	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
+		return idx;
+	}
+
+	ZVAL_STRING(&fname, "getName", 0);
+
+	idx = tw_span_create("mongo", 5 TSRMLS_CC);
+	tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
+
+	if (SUCCESS == call_user_function_ex(EG(function_table), &object, &fname, &retval_ptr, 0, NULL, 1, NULL TSRMLS_CC)) {
+		if (Z_TYPE_P(retval_ptr) == IS_STRING) {
+			tw_span_annotate_string(idx, "collection", Z_STRVAL_P(retval_ptr), 1 TSRMLS_CC);
+		}
+
+		zval_ptr_dtor(&retval_ptr);
+	}
+
+	return idx;
 }
 
 long tw_trace_callback_predis_call(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
@@ -1010,7 +1772,7 @@ long tw_trace_callback_predis_call(char *symbol, void **args, int args_len, zval
 		return -1;
 	}
 
-	return tw_trace_callback_record_with_cache("predis", 6, Z_STRVAL_P(commandId), Z_STRLEN_P(commandId), 1);
+	return tw_trace_callback_record_with_cache("predis", 6, Z_STRVAL_P(commandId), Z_STRLEN_P(commandId), 1 TSRMLS_CC);
 }
 
 long tw_trace_callback_phpampqlib(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
@@ -1028,7 +1790,7 @@ long tw_trace_callback_phpampqlib(char *symbol, void **args, int args_len, zval
 		return idx;
 	}
 
-	return tw_trace_callback_record_with_cache("queue", 5, Z_STRVAL_P(exchange), Z_STRLEN_P(exchange), 1);
+	return tw_trace_callback_record_with_cache("queue", 5, Z_STRVAL_P(exchange), Z_STRLEN_P(exchange), 1 TSRMLS_CC);
 }
 
 long tw_trace_callback_pheanstalk(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
@@ -1046,23 +1808,286 @@ long tw_trace_callback_pheanstalk(char *symbol, void **args, int args_len, zval
 	property = zend_read_property(pheanstalk_ce, object, "_using", sizeof("_using") - 1, 1 TSRMLS_CC);
 
 	if (property != NULL && Z_TYPE_P(property) == IS_STRING) {
-		return tw_trace_callback_record_with_cache("queue", 5, Z_STRVAL_P(property), Z_STRLEN_P(property), 1);
+		return tw_trace_callback_record_with_cache("queue", 5, Z_STRVAL_P(property), Z_STRLEN_P(property), 1 TSRMLS_CC);
 	} else {
-		return tw_trace_callback_record_with_cache("queue", 5, "default", 7, 1);
+		return tw_trace_callback_record_with_cache("queue", 5, "default", 7, 1 TSRMLS_CC);
 	}
 }
 
 long tw_trace_callback_memcache(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
 {
-	return tw_trace_callback_record_with_cache("memcache", 8, symbol, strlen(symbol), 1);
+	return tw_trace_callback_record_with_cache("memcache", 8, symbol, strlen(symbol), 1 TSRMLS_CC);
+}
+
+/* phpredis Redis::* and ext-memcached Memcached::*, one aggregated span per command */
+long tw_trace_callback_cache_command(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	if (strncmp(symbol, "Redis::", sizeof("Redis::")-1) == 0) {
+		return tw_span_aggregate_create("redis", 5, symbol TSRMLS_CC);
+	}
+
+	return tw_span_aggregate_create("memcache", 8, symbol TSRMLS_CC);
+}
+
+static void tw_cache_command_count_value(tw_span_aggregate *aggregate, zval *value, int lookup)
+{
+	if (Z_TYPE_P(value) == IS_STRING) {
+		aggregate->bytes += Z_STRLEN_P(value);
+		aggregate->hits += lookup;
+	} else if (Z_TYPE_P(value) == IS_BOOL && !Z_BVAL_P(value)) {
+		aggregate->misses += lookup;
+	} else if (Z_TYPE_P(value) != IS_NULL) {
+		aggregate->hits += lookup;
+	}
+}
+
+void tw_trace_callback_cache_command_end(long idx, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	tw_span_aggregate *aggregate = tw_span_aggregate_find(idx TSRMLS_CC);
+	zval *first, *ret = hp_globals.internal_return, **entry;
+	const char *method;
+	HashPosition pos;
+	long keys = 0, found = 0;
+	int lookup, i;
+
+	if (aggregate == NULL || hp_globals.entries == NULL) {
+		return;
+	}
+
+	method = strstr(hp_globals.entries->name_hprof, "::");
+	method = method ? method + 2 : hp_globals.entries->name_hprof;
+
+	/* get, getMulti, getByKey, mget, hGet, hMGet, hGetAll, ... */
+	lookup = strncasecmp(method, "get", 3) == 0 || strncasecmp(method, "mget", 4) == 0 || strncasecmp(method, "hget", 4) == 0 || strncasecmp(method, "hmget", 5) == 0;
+
+	if (args_len > 0) {
+		first = *(args-args_len);
+
+		if (Z_TYPE_P(first) == IS_ARRAY) {
+			keys = zend_hash_num_elements(Z_ARRVAL_P(first));
+		} else if (strcasecmp(method, "del") == 0 || strcasecmp(method, "delete") == 0 || strcasecmp(method, "unlink") == 0 || strcasecmp(method, "exists") == 0) {
+			for (i = 0; i < args_len; i++) {
+				keys += Z_TYPE_P(*(args-args_len+i)) == IS_STRING;
+			}
+		} else if (Z_TYPE_P(first) == IS_STRING) {
+			keys = 1;
+		}
+	}
+
+	aggregate->keys += keys;
+
+	if (ret == NULL || Z_TYPE_P(ret) == IS_OBJECT) {
+		/* pipelined and multi commands return the client, exec() has the results */
+		return;
+	}
+
+	if (Z_TYPE_P(ret) == IS_BOOL && !Z_BVAL_P(ret) && keys > 1) {
+		/* a failed multi key lookup misses all of its keys */
+		aggregate->misses += lookup ? keys : 0;
+		return;
+	}
+
+	if (Z_TYPE_P(ret) != IS_ARRAY) {
+		tw_cache_command_count_value(aggregate, ret, lookup);
+		return;
+	}
+
+	for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(ret), &pos);
+		zend_hash_get_current_data_ex(Z_ARRVAL_P(ret), (void **)&entry, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(Z_ARRVAL_P(ret), &pos)) {
+		tw_cache_command_count_value(aggregate, *entry, lookup);
+		found++;
+	}
+
+	/* Memcached::getMulti() leaves out keys that were not found */
+	if (lookup && keys > found) {
+		aggregate->misses += keys - found;
+	}
+}
+
+/**
+ * TIDEWAYS_FLAGS_AUTOLOAD: every class load through spl_autoload_call() or
+ * __autoload() is summed up in one "autoload" span, with hits for classes
+ * that exist afterwards and misses for failed lookups. Nested loads are
+ * part of the outer load and only counted as calls. The slowest loads are
+ * kept with the compile time they triggered for the "autoload_top" table.
+ * Before PHP 5.5 the engine calls the autoloader without passing through
+ * zend_execute_internal, so only explicit spl_autoload_call() calls and
+ * __autoload() are seen there.
+ */
+typedef struct tw_autoload_entry {
+	char *class_name;
+	double wt;
+	double cwt;
+} tw_autoload_entry;
+
+long tw_trace_callback_autoload(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	long idx;
+
+	if ((hp_globals.tideways_flags & TIDEWAYS_FLAGS_AUTOLOAD) == 0) {
+		return -1;
+	}
+
+	idx = tw_span_aggregate_create("autoload", 8, symbol TSRMLS_CC);
+
+	if (idx < 0) {
+		return idx;
+	}
+
+	if (hp_globals.autoload_depth++ == 0) {
+		hp_globals.autoload_compile_start = hp_globals.compile_wt;
+	}
+
+	hp_globals.autoload_span = idx;
+
+	return idx;
+}
+
+static void hp_record_autoload(const char *class_name, double wt, double cwt TSRMLS_DC)
+{
+	tw_autoload_entry *top;
+	int i;
+
+	if (hp_globals.autoload_top == NULL) {
+		hp_globals.autoload_top = ecalloc(TIDEWAYS_TOP_AUTOLOADS, sizeof(tw_autoload_entry));
+	}
+
+	top = hp_globals.autoload_top;
+	i = hp_globals.autoload_top_len;
+
+	if (i == TIDEWAYS_TOP_AUTOLOADS) {
+		if (top[i-1].wt >= wt) {
+			return;
+		}
+
+		efree(top[--i].class_name);
+	} else {
+		hp_globals.autoload_top_len++;
+	}
+
+	for (; i > 0 && top[i-1].wt < wt; i--) {
+		top[i] = top[i-1];
+	}
+
+	top[i].class_name = estrdup(class_name);
+	top[i].wt = wt;
+	top[i].cwt = cwt;
+}
+
+void tw_trace_callback_autoload_end(long idx, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	tw_span_aggregate *aggregate = tw_span_aggregate_find(idx TSRMLS_CC);
+	zval *class_name;
+	char *lcname, *name;
+	int name_len;
+	double start, wt, cwt;
+
+	if (idx < 0) {
+		return;
+	}
+
+	hp_globals.autoload_depth--;
+
+	if (aggregate == NULL || hp_globals.entries == NULL || args_len < 1) {
+		return;
+	}
+
+	class_name = *(args-args_len);
+
+	if (Z_TYPE_P(class_name) != IS_STRING) {
+		return;
+	}
+
+	start = get_us_from_tsc(hp_globals.entries->tsc_start - hp_globals.start_time);
+	wt = get_us_from_tsc(cycle_timer() - hp_globals.entries->tsc_start);
+
+	name = Z_STRVAL_P(class_name);
+	name_len = Z_STRLEN_P(class_name);
+
+	if (name_len > 0 && name[0] == '\\') {
+		name++;
+		name_len--;
+	}
+
+	lcname = zend_str_tolower_dup(name, name_len);
+
+	if (zend_hash_exists(EG(class_table), lcname, name_len+1)) {
+		aggregate->hits++;
+	} else {
+		aggregate->misses++;
+	}
+
+	efree(lcname);
+
+	if (hp_globals.autoload_depth > 0) {
+		/* already part of the outer load */
+		aggregate->wt -= wt;
+		return;
+	}
+
+	if (start < aggregate->start) {
+		aggregate->start = start;
+	}
+
+	cwt = hp_globals.compile_wt - hp_globals.autoload_compile_start;
+	hp_globals.autoload_compile_wt += cwt;
+
+	hp_record_autoload(name, wt, cwt TSRMLS_CC);
+}
+
+/* Slowest class loads as "wt/cwt class" in microseconds, slowest first */
+static void hp_annotate_autoloads(TSRMLS_D)
+{
+	smart_str buf = {0};
+	int i;
+
+	if (hp_globals.autoload_span >= 0 && hp_globals.autoload_compile_wt > 0) {
+		tw_span_annotate_long(hp_globals.autoload_span, "cwt", (long)hp_globals.autoload_compile_wt TSRMLS_CC);
+	}
+
+	for (i = 0; i < hp_globals.autoload_top_len; i++) {
+		if (i > 0) {
+			smart_str_appendl(&buf, ", ", 2);
+		}
+
+		smart_str_append_long(&buf, (long)hp_globals.autoload_top[i].wt);
+		smart_str_appendc(&buf, '/');
+		smart_str_append_long(&buf, (long)hp_globals.autoload_top[i].cwt);
+		smart_str_appendc(&buf, ' ');
+		smart_str_appends(&buf, hp_globals.autoload_top[i].class_name);
+	}
+
+	smart_str_0(&buf);
+
+	if (buf.c) {
+		tw_span_annotate_string(0, "autoload_top", buf.c, 1 TSRMLS_CC);
+		smart_str_free(&buf);
+	}
+}
+
+static void hp_clean_autoload_top(TSRMLS_D)
+{
+	int i;
+
+	for (i = 0; i < hp_globals.autoload_top_len; i++) {
+		efree(hp_globals.autoload_top[i].class_name);
+	}
+
+	if (hp_globals.autoload_top) {
+		efree(hp_globals.autoload_top);
+		hp_globals.autoload_top = NULL;
+	}
+
+	hp_globals.autoload_top_len = 0;
 }
 
 long tw_trace_callback_php_controller(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
 {
 	long idx;
 
-	idx = tw_span_create("php.ctrl", 8);
-	tw_span_annotate_string(idx, "title", symbol, 1);
+	idx = tw_span_create("php.ctrl", 8 TSRMLS_CC);
+	tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
 
 	return idx;
 }
@@ -1077,10 +2102,10 @@ long tw_trace_callback_doctrine_couchdb_request(char *symbol, void **args, int a
 		return -1;
 	}
 
-	idx = tw_span_create("http", 4);
-	tw_span_annotate_string(idx, "method", Z_STRVAL_P(method), 1);
-	tw_span_annotate_string(idx, "url", Z_STRVAL_P(path), 1);
-	tw_span_annotate_string(idx, "service", "couchdb", 1);
+	idx = tw_span_create("http", 4 TSRMLS_CC);
+	tw_span_annotate_string(idx, "method", Z_STRVAL_P(method), 1 TSRMLS_CC);
+	tw_span_annotate_string(idx, "url", Z_STRVAL_P(path), 1 TSRMLS_CC);
+	tw_span_annotate_string(idx, "service", "couchdb", 1 TSRMLS_CC);
 
 	return idx;
 }
@@ -1089,10 +2114,15 @@ long tw_trace_callback_doctrine_couchdb_request(char *symbol, void **args, int a
 long tw_trace_callback_magento_block(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
 {
 	zend_class_entry *ce;
+	long idx;
 
 	ce = Z_OBJCE_P(object);
 
-	return tw_trace_callback_record_with_cache("view", 4, (char*)ce->name, ce->name_length, 1);
+	if ((idx = hp_class_span_find(ce TSRMLS_CC)) >= 0) {
+		return idx;
+	}
+
+	return hp_class_span_remember(ce, tw_trace_callback_record_with_cache("view", 4, (char*)ce->name, ce->name_length, 1 TSRMLS_CC) TSRMLS_CC);
 }
 
 /* Zend_View_Abstract::render($name); */
@@ -1107,7 +2137,7 @@ long tw_trace_callback_view_engine(char *symbol, void **args, int args_len, zval
 
 	view = hp_get_base_filename(Z_STRVAL_P(name));
 
-	return tw_trace_callback_record_with_cache("view", 4, view, strlen(view)+1, 1);
+	return tw_trace_callback_record_with_cache("view", 4, view, strlen(view)+1, 1 TSRMLS_CC);
 }
 
 /* Applies to Enlight, Mage and Zend1 */
@@ -1130,8 +2160,8 @@ long tw_trace_callback_zend1_dispatcher_families_tx(char *symbol, void **args, i
 	ret = (char*)emalloc(len);
 	snprintf(ret, len, "%s::%s", ce->name, Z_STRVAL_P(argument_element));
 
-	idx = tw_span_create("php.ctrl", 8);
-	tw_span_annotate_string(idx, "title", ret, 0);
+	idx = tw_span_create("php.ctrl", 8 TSRMLS_CC);
+	tw_span_annotate_string(idx, "title", ret, 0 TSRMLS_CC);
 
 	return idx;
 }
@@ -1163,7 +2193,7 @@ long tw_trace_callback_oxid_tx(char *symbol, void **args, int args_len, zval *ob
 		return -1;
 	}
 
-	return tw_trace_callback_record_with_cache("php.ctrl", 8, ret, len, copy);
+	return tw_trace_callback_record_with_cache("php.ctrl", 8, ret, len, copy TSRMLS_CC);
 }
 
 /* $resolver->getArguments($request, $controller); */
@@ -1230,7 +2260,7 @@ long tw_trace_callback_pgsql_execute(char *symbol, void **args, int args_len, zv
 			// TODO: Introduce SQL statement cache to find the names here again.
 			summary = Z_STRVAL_P(argument_element);
 
-			return tw_trace_callback_record_with_cache("sql", 3, summary, strlen(summary), 1);
+			return tw_trace_callback_record_with_cache("sql", 3, summary, strlen(summary), 1 TSRMLS_CC);
 		}
 	}
 
@@ -1247,8 +2277,8 @@ long tw_trace_callback_pgsql_query(char *symbol, void **args, int args_len, zval
 		argument_element = *(args-(args_len-i));
 
 		if (argument_element && Z_TYPE_P(argument_element) == IS_STRING) {
-			idx = tw_span_create("sql", 3);
-			tw_span_annotate_string(idx, "sql", Z_STRVAL_P(argument_element), 1);
+			idx = tw_span_create("sql", 3 TSRMLS_CC);
+			tw_span_annotate_string(idx, "sql", Z_STRVAL_P(argument_element), 1 TSRMLS_CC);
 
 			return idx;
 		}
@@ -1281,13 +2311,19 @@ long tw_trace_callback_smarty3_template(char *symbol, void **args, int args_len,
 
 	template_len = Z_STRLEN_P(argument_element);
 
-	return tw_trace_callback_record_with_cache("view", 4, template, template_len, 1);
+	return tw_trace_callback_record_with_cache("view", 4, template, template_len, 1 TSRMLS_CC);
 }
 
 long tw_trace_callback_doctrine_persister(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
 {
 	zval *property;
 	zend_class_entry *persister_ce, *metadata_ce;
+	long idx;
+
+	/* one persister per entity class, its metadata does not change */
+	if ((idx = hp_object_span_find(object TSRMLS_CC)) >= 0) {
+		return idx;
+	}
 
 	persister_ce = Z_OBJCE_P(object);
 
@@ -1305,7 +2341,13 @@ long tw_trace_callback_doctrine_persister(char *symbol, void **args, int args_le
 			return -1;
 		}
 
-		return tw_trace_callback_record_with_cache("doctrine.load", 13, Z_STRVAL_P(property), Z_STRLEN_P(property), 1);
+		if (Z_TYPE_P(property) != IS_STRING) {
+			return -1;
+		}
+
+		idx = tw_trace_callback_record_with_cache("doctrine.load", 13, Z_STRVAL_P(property), Z_STRLEN_P(property), 1 TSRMLS_CC);
+
+		return hp_object_span_remember(object, idx TSRMLS_CC);
 	}
 
 	return -1;
@@ -1324,7 +2366,7 @@ long tw_trace_callback_doctrine_query(char *symbol, void **args, int args_len, z
 		return idx;
 	}
 
-	idx = tw_span_create("doctrine.query", 14);
+	idx = tw_span_create("doctrine.query", 14 TSRMLS_CC);
 
 	query_ce = Z_OBJCE_P(object);
 
@@ -1353,7 +2395,7 @@ long tw_trace_callback_doctrine_query(char *symbol, void **args, int args_len, z
 
 	if (zend_hash_get_current_data_ex(Z_ARRVAL_P(property), (void **) &tmp, &pos) == SUCCESS) {
 		if (Z_TYPE_P(*tmp) == IS_STRING) {
-			tw_span_annotate_string(idx, "title", Z_STRVAL_P(*tmp), 1);
+			tw_span_annotate_string(idx, "title", Z_STRVAL_P(*tmp), 1 TSRMLS_CC);
 		}
 	}
 
@@ -1369,11 +2411,17 @@ long tw_trace_callback_twig_template(char *symbol, void **args, int args_len, zv
 		return idx;
 	}
 
+	/* Twig compiles each template into its own class with a constant name */
+	if ((idx = hp_class_span_find(Z_OBJCE_P(object) TSRMLS_CC)) >= 0) {
+		return idx;
+	}
+
 	ZVAL_STRING(&fname, "getTemplateName", 0);
 
 	if (SUCCESS == call_user_function_ex(EG(function_table), &object, &fname, &retval_ptr, 0, NULL, 1, NULL TSRMLS_CC)) {
 		if (Z_TYPE_P(retval_ptr) == IS_STRING) {
-			idx = tw_trace_callback_record_with_cache("view", 4, Z_STRVAL_P(retval_ptr), Z_STRLEN_P(retval_ptr), 1);
+			idx = tw_trace_callback_record_with_cache("view", 4, Z_STRVAL_P(retval_ptr), Z_STRLEN_P(retval_ptr), 1 TSRMLS_CC);
+			hp_class_span_remember(Z_OBJCE_P(object), idx TSRMLS_CC);
 		}
 
 		zval_ptr_dtor(&retval_ptr);
@@ -1388,7 +2436,7 @@ long tw_trace_callback_event_dispatchers(char *symbol, void **args, int args_len
 	zval *argument_element = *(args-args_len);
 
 	if (argument_element && Z_TYPE_P(argument_element) == IS_STRING) {
-		idx = tw_trace_callback_record_with_cache("event", 5, Z_STRVAL_P(argument_element), Z_STRLEN_P(argument_element), 1);
+		idx = tw_trace_callback_record_with_cache("event", 5, Z_STRVAL_P(argument_element), Z_STRLEN_P(argument_element), 1 TSRMLS_CC);
 	}
 
 	return idx;
@@ -1399,20 +2447,20 @@ long tw_trace_callback_pdo_stmt_execute(char *symbol, void **args, int args_len,
 	long idx;
 
 	pdo_stmt_t *stmt = (pdo_stmt_t*)zend_object_store_get_object_by_handle(Z_OBJ_HANDLE_P(object) TSRMLS_CC);
-	idx = tw_span_create("sql", 3);
-	tw_span_annotate_string(idx, "sql", stmt->query_string, 1);
+	idx = tw_span_create("sql", 3 TSRMLS_CC);
+	tw_span_annotate_string(idx, "sql", stmt->query_string, 1 TSRMLS_CC);
 
 	return idx;
 }
 
 long tw_trace_callback_mysqli_stmt_execute(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
 {
-	return tw_trace_callback_record_with_cache("sql", 3, "execute", 7, 1);
+	return tw_trace_callback_record_with_cache("sql", 3, "execute", 7, 1 TSRMLS_CC);
 }
 
 long tw_trace_callback_sql_commit(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
 {
-	return tw_trace_callback_record_with_cache("sql", 3, "commit", 3, 1);
+	return tw_trace_callback_record_with_cache("sql", 3, "commit", 3, 1 TSRMLS_CC);
 }
 
 long tw_trace_callback_sql_functions(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
@@ -1430,8 +2478,8 @@ long tw_trace_callback_sql_functions(char *symbol, void **args, int args_len, zv
 		return -1;
 	}
 
-	idx = tw_span_create("sql", 3);
-	tw_span_annotate_string(idx, "sql", Z_STRVAL_P(argument_element), 1);
+	idx = tw_span_create("sql", 3 TSRMLS_CC);
+	tw_span_annotate_string(idx, "sql", Z_STRVAL_P(argument_element), 1 TSRMLS_CC);
 
 	return idx;
 }
@@ -1439,86 +2487,1323 @@ long tw_trace_callback_sql_functions(char *symbol, void **args, int args_len, zv
 long tw_trace_callback_fastcgi_finish_request(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
 {
 	// stop the main span, the request ended here
-	tw_span_timer_stop(0);
+	tw_span_timer_stop(0 TSRMLS_CC);
 	return -1;
 }
 
-long tw_trace_callback_curl_exec(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+#if defined(PHP_TIDEWAYS_HAVE_CURL) && PHP_VERSION_ID > 50399
+/**
+ * Fetch the libcurl handle behind a curl resource without going through
+ * curl_getinfo(). Returns NULL if the zval is not a cURL handle.
+ */
+static CURL *hp_curl_handle_by_id(long id TSRMLS_DC)
 {
-	zval *argument = *(args-args_len);
-	zval **option;
-	zval ***params_array;
-	char *summary;
-	long idx;
-	zval fname, *retval_ptr, *opt;
+	static int le_curl = 0;
+	php_curl *ch;
+	int type;
 
-	if (argument == NULL || Z_TYPE_P(argument) != IS_RESOURCE) {
-		return -1;
+	if (le_curl <= 0) {
+		le_curl = zend_fetch_list_dtor_id("curl");
 	}
 
-	ZVAL_STRING(&fname, "curl_getinfo", 0);
+	ch = (php_curl *)zend_list_find(id, &type);
 
-	params_array = (zval ***) emalloc(sizeof(zval **));
-	params_array[0] = &argument;
+	if (ch == NULL || type != le_curl) {
+		return NULL;
+	}
+
+	return ch->cp;
+}
+
+static CURL *hp_curl_handle(zval *zid TSRMLS_DC)
+{
+	if (zid == NULL || Z_TYPE_P(zid) != IS_RESOURCE) {
+		return NULL;
+	}
+
+	return hp_curl_handle_by_id(Z_RESVAL_P(zid) TSRMLS_CC);
+}
+
+static void hp_curl_annotate_time(long idx, char *key, CURL *cp, CURLINFO info TSRMLS_DC)
+{
+	double value;
+
+	if (curl_easy_getinfo(cp, info, &value) == CURLE_OK && value > 0) {
+		tw_span_annotate_long(idx, key, (long)(value * 1000000) TSRMLS_CC);
+	}
+}
+
+/**
+ * Handles created while profiling, with a copy of the headers the
+ * application set, so the trace header can be added to them and the
+ * original list be restored after the transfer. Handles created before
+ * tideways_enable() are never injected, their headers are unknown.
+ *
+ * The list ext/curl built is not reachable from here, restoring sets a
+ * list of our own built from the same headers. The handle may use it
+ * until it is closed, so it lives in curl_restored until the next
+ * injection on that handle or the end of the request.
+ */
+typedef struct tw_curl_trace {
+	zval *headers;
+	struct curl_slist *injected;
+} tw_curl_trace;
+
+static struct curl_slist *hp_curl_header_list(zval *headers)
+{
+	struct curl_slist *list = NULL;
+	HashPosition pos;
+	zval **entry, tmp;
+
+	if (headers == NULL) {
+		return NULL;
+	}
+
+	for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(headers), &pos);
+		zend_hash_get_current_data_ex(Z_ARRVAL_P(headers), (void **)&entry, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(Z_ARRVAL_P(headers), &pos)) {
+		tmp = **entry;
+		zval_copy_ctor(&tmp);
+		convert_to_string(&tmp);
+		list = curl_slist_append(list, Z_STRVAL(tmp));
+		zval_dtor(&tmp);
+	}
+
+	return list;
+}
+
+static void hp_free_curl_slist(void *data)
+{
+	curl_slist_free_all(*(struct curl_slist **)data);
+}
+
+static void hp_curl_set_restored(ulong handle, CURL *cp, zval *headers TSRMLS_DC)
+{
+	struct curl_slist *list = hp_curl_header_list(headers);
+
+	curl_easy_setopt(cp, CURLOPT_HTTPHEADER, list);
+
+	if (hp_globals.curl_restored == NULL) {
+		ALLOC_HASHTABLE(hp_globals.curl_restored);
+		zend_hash_init(hp_globals.curl_restored, 16, NULL, hp_free_curl_slist, 0);
+	}
+
+	if (list != NULL) {
+		zend_hash_index_update(hp_globals.curl_restored, handle, &list, sizeof(struct curl_slist *), NULL);
+	} else {
+		zend_hash_index_del(hp_globals.curl_restored, handle);
+	}
+}
+
+static void hp_curl_restore_headers(ulong handle, tw_curl_trace *trace TSRMLS_DC)
+{
+	CURL *cp;
+
+	if (trace->injected == NULL) {
+		return;
+	}
+
+	if ((cp = hp_curl_handle_by_id(handle TSRMLS_CC)) != NULL) {
+		hp_curl_set_restored(handle, cp, trace->headers TSRMLS_CC);
+	}
+
+	curl_slist_free_all(trace->injected);
+	trace->injected = NULL;
+}
+
+static void hp_free_curl_restored(TSRMLS_D)
+{
+	if (hp_globals.curl_restored == NULL) {
+		return;
+	}
+
+	zend_hash_destroy(hp_globals.curl_restored);
+	FREE_HASHTABLE(hp_globals.curl_restored);
+	hp_globals.curl_restored = NULL;
+}
+
+static void hp_curl_inject_trace(ulong handle, CURL *cp, long idx TSRMLS_DC)
+{
+	char header[sizeof(TIDEWAYS_TRACE_HEADER) + TIDEWAYS_TRACE_ID_LEN + 24];
+	struct curl_slist *list;
+	tw_curl_trace *trace;
+	char *url = NULL;
+
+	if (idx < 0 || hp_globals.tracing_hosts == NULL || hp_globals.curl_traces == NULL) {
+		return;
+	}
+
+	if (zend_hash_index_find(hp_globals.curl_traces, handle, (void **)&trace) == FAILURE || trace->injected != NULL) {
+		return;
+	}
+
+	if (curl_easy_getinfo(cp, CURLINFO_EFFECTIVE_URL, &url) != CURLE_OK || url == NULL || !hp_tracing_host_allowed(url TSRMLS_CC)) {
+		return;
+	}
+
+	list = hp_curl_header_list(trace->headers);
+	snprintf(header, sizeof(header), "%s: %s-%ld", TIDEWAYS_TRACE_HEADER, hp_globals.trace_id, idx);
+	list = curl_slist_append(list, header);
+
+	curl_easy_setopt(cp, CURLOPT_HTTPHEADER, list);
+	trace->injected = list;
+
+	/* the handle no longer uses the list set by a previous restore */
+	if (hp_globals.curl_restored != NULL) {
+		zend_hash_index_del(hp_globals.curl_restored, handle);
+	}
+}
+
+static void hp_free_curl_trace(void *data)
+{
+	tw_curl_trace *trace = (tw_curl_trace *)data;
+
+	if (trace->headers) {
+		zval_ptr_dtor(&trace->headers);
+	}
+
+	if (trace->injected) {
+		curl_slist_free_all(trace->injected);
+	}
+}
+
+static int hp_restore_curl_trace(void *data TSRMLS_DC, int num_args, va_list args, zend_hash_key *hash_key)
+{
+	hp_curl_restore_headers(hash_key->h, (tw_curl_trace *)data TSRMLS_CC);
+
+	return ZEND_HASH_APPLY_KEEP;
+}
+
+static void hp_clean_curl_traces(TSRMLS_D)
+{
+	if (hp_globals.curl_traces == NULL) {
+		return;
+	}
+
+	zend_hash_apply_with_arguments(hp_globals.curl_traces TSRMLS_CC, hp_restore_curl_trace, 0);
+	zend_hash_destroy(hp_globals.curl_traces);
+	FREE_HASHTABLE(hp_globals.curl_traces);
+	hp_globals.curl_traces = NULL;
+}
+
+/* Track the handle curl_init() or curl_copy_handle() returned */
+static void hp_curl_track_handle(tw_curl_trace *source TSRMLS_DC)
+{
+	zval *handle = hp_globals.internal_return;
+	tw_curl_trace trace;
+
+	if (hp_globals.tracing_hosts == NULL || handle == NULL || Z_TYPE_P(handle) != IS_RESOURCE) {
+		return;
+	}
+
+	if (hp_globals.curl_traces == NULL) {
+		ALLOC_HASHTABLE(hp_globals.curl_traces);
+		zend_hash_init(hp_globals.curl_traces, 16, NULL, hp_free_curl_trace, 0);
+	}
+
+	trace.headers = NULL;
+	trace.injected = NULL;
+
+	if (source != NULL && source->headers != NULL) {
+		trace.headers = source->headers;
+		Z_ADDREF_P(trace.headers);
+	}
+
+	zend_hash_index_update(hp_globals.curl_traces, Z_RESVAL_P(handle), &trace, sizeof(tw_curl_trace), NULL);
+}
+
+static tw_curl_trace *hp_curl_find_trace(zval *zid TSRMLS_DC)
+{
+	tw_curl_trace *trace;
+
+	if (hp_globals.curl_traces == NULL || zid == NULL || Z_TYPE_P(zid) != IS_RESOURCE) {
+		return NULL;
+	}
+
+	if (zend_hash_index_find(hp_globals.curl_traces, Z_RESVAL_P(zid), (void **)&trace) == FAILURE) {
+		return NULL;
+	}
+
+	return trace;
+}
+
+static void hp_curl_set_headers(tw_curl_trace *trace, zval *headers)
+{
+	zval *copy = NULL;
+
+	if (headers != NULL && Z_TYPE_P(headers) == IS_ARRAY) {
+		MAKE_STD_ZVAL(copy);
+		*copy = *headers;
+		zval_copy_ctor(copy);
+		INIT_PZVAL(copy);
+	}
+
+	if (trace->headers) {
+		zval_ptr_dtor(&trace->headers);
+	}
+
+	trace->headers = copy;
+}
+
+long tw_trace_callback_curl_init(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	return -1;
+}
+
+void tw_trace_callback_curl_init_end(long idx, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	hp_curl_track_handle(NULL TSRMLS_CC);
+}
+
+void tw_trace_callback_curl_copy_handle_end(long idx, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	zval *zid, *copy = hp_globals.internal_return;
+	tw_curl_trace *source;
+	CURL *cp;
+
+	if (args_len < 1 || (source = hp_curl_find_trace((zid = *(args-args_len)) TSRMLS_CC)) == NULL) {
+		return;
+	}
+
+	hp_curl_track_handle(source TSRMLS_CC);
+
+	/* libcurl copies the list pointer only, give the copy a restored list of its own */
+	if (hp_globals.curl_restored != NULL && zend_hash_index_exists(hp_globals.curl_restored, Z_RESVAL_P(zid)) &&
+		(cp = hp_curl_handle(copy TSRMLS_CC)) != NULL) {
+		hp_curl_set_restored(Z_RESVAL_P(copy), cp, source->headers TSRMLS_CC);
+	}
+}
+
+long tw_trace_callback_curl_setopt(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	tw_curl_trace *trace;
+	zval *option, **value;
+
+	if (args_len < 1 || (trace = hp_curl_find_trace(*(args-args_len) TSRMLS_CC)) == NULL) {
+		return -1;
+	}
+
+	if (strcmp(symbol, "curl_reset") == 0) {
+		hp_curl_set_headers(trace, NULL);
+	} else if (strcmp(symbol, "curl_setopt_array") == 0 && args_len >= 2) {
+		option = *(args-args_len+1);
+
+		if (Z_TYPE_P(option) == IS_ARRAY && zend_hash_index_find(Z_ARRVAL_P(option), CURLOPT_HTTPHEADER, (void **)&value) == SUCCESS) {
+			hp_curl_set_headers(trace, *value);
+		}
+	} else if (args_len >= 3) {
+		option = *(args-args_len+1);
+
+		if (Z_TYPE_P(option) == IS_LONG && Z_LVAL_P(option) == CURLOPT_HTTPHEADER) {
+			hp_curl_set_headers(trace, *(args-args_len+2));
+		}
+	}
+
+	return -1;
+}
+
+long tw_trace_callback_curl_exec(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	zval *zid = *(args-args_len);
+	CURL *cp = hp_curl_handle(zid TSRMLS_CC);
+	char *url = NULL;
+	long idx;
+
+	if (cp == NULL || curl_easy_getinfo(cp, CURLINFO_EFFECTIVE_URL, &url) != CURLE_OK || url == NULL) {
+		return -1;
+	}
+
+	idx = tw_span_create("http", 4 TSRMLS_CC);
+	tw_span_annotate_string(idx, "url", (char*)hp_get_file_summary(url, strlen(url) TSRMLS_CC), 1 TSRMLS_CC);
+
+	hp_curl_inject_trace(Z_RESVAL_P(zid), cp, idx TSRMLS_CC);
+
+	return idx;
+}
+
+/* Timings in microseconds relative to the start of the transfer, see curl_easy_getinfo(3) */
+static void hp_curl_annotate_transfer(long idx, CURL *cp TSRMLS_DC)
+{
+	long status;
+
+	hp_curl_annotate_time(idx, "dns", cp, CURLINFO_NAMELOOKUP_TIME TSRMLS_CC);
+	hp_curl_annotate_time(idx, "connect", cp, CURLINFO_CONNECT_TIME TSRMLS_CC);
+	hp_curl_annotate_time(idx, "tls", cp, CURLINFO_APPCONNECT_TIME TSRMLS_CC);
+	hp_curl_annotate_time(idx, "ttfb", cp, CURLINFO_STARTTRANSFER_TIME TSRMLS_CC);
+	hp_curl_annotate_time(idx, "total", cp, CURLINFO_TOTAL_TIME TSRMLS_CC);
+
+	if (curl_easy_getinfo(cp, CURLINFO_RESPONSE_CODE, &status) == CURLE_OK && status > 0) {
+		tw_span_annotate_long(idx, "status", status TSRMLS_CC);
+	}
+}
+
+void tw_trace_callback_curl_exec_end(long idx, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	zval *zid = *(args-args_len);
+	CURL *cp = hp_curl_handle(zid TSRMLS_CC);
+	tw_curl_trace *trace;
+
+	if (cp == NULL) {
+		return;
+	}
+
+	if (idx >= 0) {
+		hp_curl_annotate_transfer(idx, cp TSRMLS_CC);
+	}
+
+	if ((trace = hp_curl_find_trace(zid TSRMLS_CC)) != NULL) {
+		hp_curl_restore_headers(Z_RESVAL_P(zid), trace TSRMLS_CC);
+	}
+}
+
+/**
+ * Transfers added to a curl_multi handle run in the background of
+ * curl_multi_exec(), so their spans are created by the first
+ * curl_multi_exec() call after adding, which starts them, and timed when the
+ * handle is removed again or profiling stops, with the end from the total
+ * time libcurl measured. Handles never executed get no span.
+ */
+typedef struct tw_curl_transfer {
+	long multi;
+	long idx;
+	double started;
+} tw_curl_transfer;
+
+static inline double hp_curl_now(TSRMLS_D)
+{
+	return get_us_from_tsc(cycle_timer() - hp_globals.start_time);
+}
+
+static void hp_curl_multi_finish(tw_curl_transfer *transfer, long handle TSRMLS_DC)
+{
+	tw_curl_trace *trace;
+	CURL *cp;
+	char *url = NULL;
+	double total;
+	long idx = transfer->idx;
+
+	if (hp_globals.curl_traces != NULL && zend_hash_index_find(hp_globals.curl_traces, handle, (void **)&trace) == SUCCESS) {
+		hp_curl_restore_headers(handle, trace TSRMLS_CC);
+	}
+
+	if (transfer->started < 0 || idx < 0) {
+		return;
+	}
+
+	cp = hp_curl_handle_by_id(handle TSRMLS_CC);
+
+	if (cp == NULL || curl_easy_getinfo(cp, CURLINFO_EFFECTIVE_URL, &url) != CURLE_OK || url == NULL) {
+		return;
+	}
+
+	if (curl_easy_getinfo(cp, CURLINFO_TOTAL_TIME, &total) != CURLE_OK || total <= 0) {
+		total = (hp_curl_now(TSRMLS_C) - transfer->started) / 1000000;
+	}
+
+	tw_span_record_duration(idx, transfer->started, transfer->started + total * 1000000 TSRMLS_CC);
+	tw_span_annotate_string(idx, "url", (char*)hp_get_file_summary(url, strlen(url) TSRMLS_CC), 1 TSRMLS_CC);
+	tw_span_annotate_long(idx, "multi", 1 TSRMLS_CC);
+	hp_curl_annotate_transfer(idx, cp TSRMLS_CC);
+}
+
+long tw_trace_callback_curl_multi_add_handle(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	zval *mh, *zid;
+	tw_curl_transfer transfer;
+
+	if (args_len < 2) {
+		return -1;
+	}
+
+	mh = *(args-args_len);
+	zid = *(args-args_len+1);
+
+	if (Z_TYPE_P(mh) != IS_RESOURCE || hp_curl_handle(zid TSRMLS_CC) == NULL) {
+		return -1;
+	}
+
+	if (hp_globals.curl_multi_transfers == NULL) {
+		ALLOC_HASHTABLE(hp_globals.curl_multi_transfers);
+		zend_hash_init(hp_globals.curl_multi_transfers, 16, NULL, NULL, 0);
+	}
+
+	transfer.multi = Z_RESVAL_P(mh);
+	transfer.idx = -1;
+	transfer.started = -1;
+
+	zend_hash_index_update(hp_globals.curl_multi_transfers, Z_RESVAL_P(zid), &transfer, sizeof(tw_curl_transfer), NULL);
+
+	return -1;
+}
+
+long tw_trace_callback_curl_multi_exec(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	zval *mh = *(args-args_len);
+	tw_curl_transfer *transfer;
+	HashPosition pos;
+	ulong handle;
+	double now;
+	CURL *cp;
+
+	if (hp_globals.curl_multi_transfers == NULL || Z_TYPE_P(mh) != IS_RESOURCE) {
+		return -1;
+	}
+
+	now = hp_curl_now(TSRMLS_C);
+
+	for (zend_hash_internal_pointer_reset_ex(hp_globals.curl_multi_transfers, &pos);
+		zend_hash_get_current_data_ex(hp_globals.curl_multi_transfers, (void **)&transfer, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(hp_globals.curl_multi_transfers, &pos)) {
+		if (transfer->multi != Z_RESVAL_P(mh) || transfer->started >= 0) {
+			continue;
+		}
+
+		zend_hash_get_current_key_ex(hp_globals.curl_multi_transfers, NULL, NULL, &handle, 0, &pos);
+
+		transfer->started = now;
+		transfer->idx = tw_span_create("http", 4 TSRMLS_CC);
+
+		if ((cp = hp_curl_handle_by_id(handle TSRMLS_CC)) != NULL) {
+			hp_curl_inject_trace(handle, cp, transfer->idx TSRMLS_CC);
+		}
+	}
+
+	return -1;
+}
+
+long tw_trace_callback_curl_multi_remove_handle(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	zval *zid;
+	tw_curl_transfer *transfer;
+
+	if (args_len < 2 || hp_globals.curl_multi_transfers == NULL) {
+		return -1;
+	}
+
+	zid = *(args-args_len+1);
+
+	if (Z_TYPE_P(zid) != IS_RESOURCE) {
+		return -1;
+	}
+
+	if (zend_hash_index_find(hp_globals.curl_multi_transfers, Z_RESVAL_P(zid), (void **)&transfer) == SUCCESS) {
+		hp_curl_multi_finish(transfer, Z_RESVAL_P(zid) TSRMLS_CC);
+		zend_hash_index_del(hp_globals.curl_multi_transfers, Z_RESVAL_P(zid));
+	}
+
+	return -1;
+}
+
+/* Transfers still attached when profiling stops end with what libcurl measured so far */
+static void hp_finish_curl_multi_transfers(TSRMLS_D)
+{
+	tw_curl_transfer *transfer;
+	HashPosition pos;
+	ulong handle;
+
+	if (hp_globals.curl_multi_transfers == NULL) {
+		return;
+	}
+
+	for (zend_hash_internal_pointer_reset_ex(hp_globals.curl_multi_transfers, &pos);
+		zend_hash_get_current_data_ex(hp_globals.curl_multi_transfers, (void **)&transfer, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(hp_globals.curl_multi_transfers, &pos)) {
+		zend_hash_get_current_key_ex(hp_globals.curl_multi_transfers, NULL, NULL, &handle, 0, &pos);
+		hp_curl_multi_finish(transfer, handle TSRMLS_CC);
+	}
+
+	zend_hash_clean(hp_globals.curl_multi_transfers);
+}
+
+/* curl_multi_close() detaches all handles that were not removed explicitly */
+long tw_trace_callback_curl_multi_close(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	zval *mh = *(args-args_len);
+	tw_curl_transfer *transfer;
+	HashPosition pos;
+	ulong handle;
+
+	if (hp_globals.curl_multi_transfers == NULL || Z_TYPE_P(mh) != IS_RESOURCE) {
+		return -1;
+	}
+
+	zend_hash_internal_pointer_reset_ex(hp_globals.curl_multi_transfers, &pos);
+
+	while (zend_hash_get_current_data_ex(hp_globals.curl_multi_transfers, (void **)&transfer, &pos) == SUCCESS) {
+		zend_hash_get_current_key_ex(hp_globals.curl_multi_transfers, NULL, NULL, &handle, 0, &pos);
+		zend_hash_move_forward_ex(hp_globals.curl_multi_transfers, &pos);
+
+		if (transfer->multi == Z_RESVAL_P(mh)) {
+			hp_curl_multi_finish(transfer, handle TSRMLS_CC);
+			zend_hash_index_del(hp_globals.curl_multi_transfers, handle);
+		}
+	}
+
+	return -1;
+}
+#else
+long tw_trace_callback_curl_exec(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	zval *argument = *(args-args_len);
+	zval **option;
+	zval ***params_array;
+	const char *summary;
+	long idx;
+	zval fname, *retval_ptr, *opt;
+
+	if (argument == NULL || Z_TYPE_P(argument) != IS_RESOURCE) {
+		return -1;
+	}
+
+	ZVAL_STRING(&fname, "curl_getinfo", 0);
+
+	params_array = (zval ***) emalloc(sizeof(zval **));
+	params_array[0] = &argument;
 
 	if (SUCCESS == call_user_function_ex(EG(function_table), NULL, &fname, &retval_ptr, 1, params_array, 1, NULL TSRMLS_CC)) {
 		if (zend_hash_find(Z_ARRVAL_P(retval_ptr), "url", sizeof("url"), (void **)&option) == SUCCESS) {
 			summary = hp_get_file_summary(Z_STRVAL_PP(option), Z_STRLEN_PP(option) TSRMLS_CC);
 
-			efree(params_array);
-			zval_ptr_dtor(&retval_ptr);
+			idx = tw_span_create("http", 4 TSRMLS_CC);
+			tw_span_annotate_string(idx, "url", (char*)summary, 1 TSRMLS_CC);
+
+			efree(params_array);
+			zval_ptr_dtor(&retval_ptr);
+			return idx;
+		}
+
+		zval_ptr_dtor(&retval_ptr);
+	}
+
+	efree(params_array);
+
+	return -1;
+}
+
+#define tw_trace_callback_curl_exec_end NULL
+
+static void hp_finish_curl_multi_transfers(TSRMLS_D)
+{
+}
+
+static void hp_clean_curl_traces(TSRMLS_D)
+{
+}
+
+static void hp_free_curl_restored(TSRMLS_D)
+{
+}
+#endif
+
+long tw_trace_callback_soap_client_dorequest(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+{
+	if (args_len < 2) {
+		return -1;
+	}
+
+	long idx = -1;
+	zval *argument = *(args-args_len+1);
+
+	if (Z_TYPE_P(argument) != IS_STRING) {
+		return idx;
+	}
+
+	idx = tw_span_create("http", 4 TSRMLS_CC);
+	tw_span_annotate_string(idx, "url", Z_STRVAL_P(argument), 1 TSRMLS_CC);
+	tw_span_annotate_string(idx, "method", "POST", 1 TSRMLS_CC);
+	tw_span_annotate_string(idx, "service", "soap", 1 TSRMLS_CC);
+
+	return idx;
+}
+
+/**
+ * HTTP through PHP streams (file_get_contents, fopen, SoapClient, Guzzle's
+ * stream handler) is traced by wrapping the opener of the http/https stream
+ * wrapper. The span starts with the open and ends when the stream resource
+ * is destroyed, the connect time is taken from the context notifier when
+ * the application has not installed its own, or when profiling stops for
+ * streams still open then. The stream keeps its ops, code
+ * like php_stream_is() or the openssl wrapper compares them by address.
+ */
+typedef struct tw_http_stream {
+	long idx;
+	double start;
+	double connect;
+} tw_http_stream;
+
+static php_stream_wrapper *tw_http_wrapper = NULL;
+static php_stream_wrapper_ops *tw_http_original_wops = NULL;
+static php_stream_wrapper_ops tw_http_wops;
+
+static inline double hp_stream_now(TSRMLS_D)
+{
+	return get_us_from_tsc(cycle_timer() - hp_globals.start_time);
+}
+
+/* Called for every stream resource destroyed while streams are tracked */
+static void hp_stream_closed(php_stream *stream TSRMLS_DC)
+{
+	tw_http_stream *entry;
+
+	if (hp_globals.http_streams != NULL &&
+		zend_hash_index_find(hp_globals.http_streams, (zend_uintptr_t)stream, (void **)&entry) == SUCCESS) {
+		if (hp_globals.enabled) {
+			tw_span_record_duration(entry->idx, entry->start, hp_stream_now(TSRMLS_C) TSRMLS_CC);
+		}
+
+		zend_hash_index_del(hp_globals.http_streams, (zend_uintptr_t)stream);
+	}
+
+	if (hp_globals.io_streams != NULL) {
+		zend_hash_index_del(hp_globals.io_streams, (zend_uintptr_t)stream);
+	}
+}
+
+static void hp_finish_http_streams(TSRMLS_D)
+{
+	tw_http_stream *entry;
+	HashPosition pos;
+	double now;
+
+	if (hp_globals.http_streams == NULL) {
+		return;
+	}
+
+	now = hp_stream_now(TSRMLS_C);
+
+	for (zend_hash_internal_pointer_reset_ex(hp_globals.http_streams, &pos);
+		zend_hash_get_current_data_ex(hp_globals.http_streams, (void **)&entry, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(hp_globals.http_streams, &pos)) {
+		tw_span_record_duration(entry->idx, entry->start, now TSRMLS_CC);
+	}
+
+	zend_hash_clean(hp_globals.http_streams);
+}
+
+/**
+ * Destructor of EG(regular_list) while streams are tracked. Closing a stream
+ * releases its resource, either directly or when the last reference to it
+ * goes away, so this sees every stream close without touching stream->ops.
+ */
+static void tw_stream_rsrc_dtor(void *data)
+{
+	zend_rsrc_list_entry *le = (zend_rsrc_list_entry *)data;
+	TSRMLS_FETCH();
+
+	if (le->type == php_file_le_stream()) {
+		hp_stream_closed((php_stream *)le->ptr TSRMLS_CC);
+	}
+
+	hp_globals.regular_list_dtor(data);
+}
+
+static void hp_track_stream_close(TSRMLS_D)
+{
+	if (EG(regular_list).pDestructor != tw_stream_rsrc_dtor) {
+		hp_globals.regular_list_dtor = EG(regular_list).pDestructor;
+		EG(regular_list).pDestructor = tw_stream_rsrc_dtor;
+	}
+}
+
+static void hp_untrack_stream_close(TSRMLS_D)
+{
+	if (EG(regular_list).pDestructor == tw_stream_rsrc_dtor) {
+		EG(regular_list).pDestructor = hp_globals.regular_list_dtor;
+	}
+}
+
+static void tw_http_stream_notify(php_stream_context *context, int notifycode, int severity,
+		char *xmsg, int xcode, size_t bytes_sofar, size_t bytes_max, void *ptr TSRMLS_DC)
+{
+	if (notifycode == PHP_STREAM_NOTIFY_CONNECT && hp_globals.http_opening != NULL && hp_globals.http_opening->connect < 0) {
+		hp_globals.http_opening->connect = hp_stream_now(TSRMLS_C) - hp_globals.http_opening->start;
+	}
+}
+
+static void tw_http_stream_annotate_status(long idx, php_stream *stream TSRMLS_DC)
+{
+	zval **line;
+
+	if (stream->wrapperdata == NULL || Z_TYPE_P(stream->wrapperdata) != IS_ARRAY) {
+		return;
+	}
+
+	zend_hash_internal_pointer_reset(Z_ARRVAL_P(stream->wrapperdata));
+
+	/* "HTTP/1.1 200 OK" */
+	if (zend_hash_get_current_data(Z_ARRVAL_P(stream->wrapperdata), (void **)&line) == SUCCESS &&
+		Z_TYPE_PP(line) == IS_STRING && Z_STRLEN_PP(line) > 12 && strncasecmp(Z_STRVAL_PP(line), "HTTP/", 5) == 0) {
+		tw_span_annotate_long(idx, "status", strtol(Z_STRVAL_PP(line) + 9, NULL, 10) TSRMLS_CC);
+	}
+}
+
+static php_stream *tw_http_stream_opener(php_stream_wrapper *wrapper, TW_STREAM_CONST char *path, TW_STREAM_CONST char *mode,
+		int options, char **opened_path, php_stream_context *context STREAMS_DC TSRMLS_DC)
+{
+	php_stream_notifier *notifier = NULL;
+	php_stream *stream;
+	tw_http_stream entry;
+
+	if (!hp_globals.enabled || (hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_SPANS) > 0 ||
+		(hp_globals.trace_packs & TW_PACK_HTTP) == 0 || hp_globals.http_opening != NULL) {
+		return tw_http_original_wops->stream_opener(wrapper, path, mode, options, opened_path, context STREAMS_REL_CC TSRMLS_CC);
+	}
+
+	entry.idx = tw_span_create("http", 4 TSRMLS_CC);
+	entry.start = hp_stream_now(TSRMLS_C);
+	entry.connect = -1;
+
+	if (entry.idx >= 0) {
+		tw_span_annotate_string(entry.idx, "url", (char*)hp_get_file_summary((char*)path, strlen(path) TSRMLS_CC), 1 TSRMLS_CC);
+	}
+
+	if (context != NULL && context->notifier == NULL) {
+		notifier = php_stream_notification_alloc();
+		notifier->func = tw_http_stream_notify;
+		notifier->mask = -1;
+		context->notifier = notifier;
+	}
+
+	hp_globals.http_opening = &entry;
+	stream = tw_http_original_wops->stream_opener(wrapper, path, mode, options, opened_path, context STREAMS_REL_CC TSRMLS_CC);
+	hp_globals.http_opening = NULL;
+
+	if (notifier != NULL && context->notifier == notifier) {
+		context->notifier = NULL;
+		php_stream_notification_free(notifier);
+	}
+
+	if (entry.idx < 0) {
+		return stream;
+	}
+
+	if (entry.connect >= 0) {
+		tw_span_annotate_long(entry.idx, "connect", (long)entry.connect TSRMLS_CC);
+	}
+
+	if (stream == NULL) {
+		tw_span_record_duration(entry.idx, entry.start, hp_stream_now(TSRMLS_C) TSRMLS_CC);
+		return stream;
+	}
+
+	tw_span_annotate_long(entry.idx, "ttfb", (long)(hp_stream_now(TSRMLS_C) - entry.start) TSRMLS_CC);
+	tw_http_stream_annotate_status(entry.idx, stream TSRMLS_CC);
+
+	if (hp_globals.http_streams == NULL) {
+		ALLOC_HASHTABLE(hp_globals.http_streams);
+		zend_hash_init(hp_globals.http_streams, 8, NULL, NULL, 0);
+	}
+
+	zend_hash_index_update(hp_globals.http_streams, (zend_uintptr_t)stream, &entry, sizeof(tw_http_stream), NULL);
+	hp_track_stream_close(TSRMLS_C);
+
+	return stream;
+}
+
+static void hp_init_http_stream_wrapper(TSRMLS_D)
+{
+	php_stream_wrapper **wrapper;
+
+	if (zend_hash_find(php_stream_get_url_stream_wrappers_hash_global(), "http", sizeof("http"), (void **)&wrapper) == FAILURE) {
+		return;
+	}
+
+	tw_http_wrapper = *wrapper;
+	tw_http_original_wops = tw_http_wrapper->wops;
+	tw_http_wops = *tw_http_original_wops;
+	tw_http_wops.stream_opener = tw_http_stream_opener;
+	tw_http_wrapper->wops = &tw_http_wops;
+}
+
+static void hp_free_http_stream_wrapper(TSRMLS_D)
+{
+	if (tw_http_wrapper != NULL) {
+		tw_http_wrapper->wops = tw_http_original_wops;
+		tw_http_wrapper = NULL;
+	}
+}
+
+/**
+ * File I/O accounting (TIDEWAYS_FLAGS_FILE_IO). The plain files wrapper is
+ * wrapped to count opens, reads, writes and stats with their bytes and time
+ * per path prefix from tideways.file_io_prefixes. The totals are annotated
+ * on the app span as "io:<prefix>", paths outside all prefixes as "io:other".
+ * Reads and writes are seen through php_stream_stdio_ops, whose handlers are
+ * replaced in place by hp_install_hooks() when FILE_IO is set, so streams
+ * keep the ops code compares with php_stream_is() and in cast, flock and
+ * mmap. Failed opens are not counted. Code using file descriptors directly
+ * (e.g. the files session handler) is not seen.
+ */
+typedef struct tw_io_bucket {
+	char *prefix;
+	int prefix_len;
+	long opens;
+	long reads;
+	long writes;
+	long stats;
+	long bytes_read;
+	long bytes_written;
+	double wt;
+} tw_io_bucket;
+
+/* Count a probe of path in a top offenders table, created on first use */
+static void hp_count_path(HashTable **paths, const char *path TSRMLS_DC)
+{
+	long count = 1, *found;
+	int len = strlen(path);
+
+	if (*paths == NULL) {
+		ALLOC_HASHTABLE(*paths);
+		zend_hash_init(*paths, 64, NULL, NULL, 0);
+	}
+
+	if (zend_hash_find(*paths, path, len+1, (void **)&found) == SUCCESS) {
+		(*found)++;
+	} else if (zend_hash_num_elements(*paths) < TIDEWAYS_MAX_STAT_PATHS) {
+		zend_hash_add(*paths, path, len+1, &count, sizeof(long), NULL);
+	}
+}
+
+static inline int hp_count_stats_enabled(TSRMLS_D)
+{
+	return hp_globals.enabled && (hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_SPANS) == 0;
+}
+
+static php_stream_wrapper_ops *tw_plain_original_wops = NULL;
+static php_stream_wrapper_ops tw_plain_wops;
+static size_t (*tw_stdio_original_read)(php_stream *stream, char *buf, size_t count TSRMLS_DC) = NULL;
+static size_t (*tw_stdio_original_write)(php_stream *stream, const char *buf, size_t count TSRMLS_DC) = NULL;
+
+static inline int hp_file_io_enabled(TSRMLS_D)
+{
+	return hp_globals.enabled && hp_globals.io_buckets != NULL;
+}
+
+static int hp_file_io_bucket(const char *path TSRMLS_DC)
+{
+	char resolved[MAXPATHLEN];
+	int i, found = -1, found_len = 0;
+
+	if (!IS_ABSOLUTE_PATH(path, strlen(path)) && expand_filepath(path, resolved TSRMLS_CC) != NULL) {
+		path = resolved;
+	}
+
+	/* longest matching prefix wins, the last bucket is "other" */
+	for (i = 0; i < hp_globals.io_buckets_len - 1; i++) {
+		if (hp_globals.io_buckets[i].prefix_len > found_len && strncmp(path, hp_globals.io_buckets[i].prefix, hp_globals.io_buckets[i].prefix_len) == 0) {
+			found = i;
+			found_len = hp_globals.io_buckets[i].prefix_len;
+		}
+	}
+
+	return found >= 0 ? found : hp_globals.io_buckets_len - 1;
+}
+
+static tw_io_bucket *hp_file_io_stream_bucket(php_stream *stream TSRMLS_DC)
+{
+	int *bucket;
+
+	if (!hp_file_io_enabled(TSRMLS_C) || hp_globals.io_streams == NULL ||
+		zend_hash_index_find(hp_globals.io_streams, (zend_uintptr_t)stream, (void **)&bucket) == FAILURE) {
+		return NULL;
+	}
+
+	return &hp_globals.io_buckets[*bucket];
+}
+
+static size_t tw_plain_stream_read(php_stream *stream, char *buf, size_t count TSRMLS_DC)
+{
+	tw_io_bucket *bucket = hp_file_io_stream_bucket(stream TSRMLS_CC);
+	uint64 start;
+	size_t ret;
+
+	if (bucket == NULL) {
+		return tw_stdio_original_read(stream, buf, count TSRMLS_CC);
+	}
+
+	start = cycle_timer();
+	ret = tw_stdio_original_read(stream, buf, count TSRMLS_CC);
+
+	bucket->reads++;
+	bucket->bytes_read += ret;
+	bucket->wt += get_us_from_tsc(cycle_timer() - start);
+
+	return ret;
+}
+
+static size_t tw_plain_stream_write(php_stream *stream, const char *buf, size_t count TSRMLS_DC)
+{
+	tw_io_bucket *bucket = hp_file_io_stream_bucket(stream TSRMLS_CC);
+	uint64 start;
+	size_t ret;
+
+	if (bucket == NULL) {
+		return tw_stdio_original_write(stream, buf, count TSRMLS_CC);
+	}
+
+	start = cycle_timer();
+	ret = tw_stdio_original_write(stream, buf, count TSRMLS_CC);
+
+	bucket->writes++;
+	bucket->bytes_written += ret;
+	bucket->wt += get_us_from_tsc(cycle_timer() - start);
+
+	return ret;
+}
+
+static php_stream *tw_plain_stream_opener(php_stream_wrapper *wrapper, TW_STREAM_CONST char *path, TW_STREAM_CONST char *mode,
+		int options, char **opened_path, php_stream_context *context STREAMS_DC TSRMLS_DC)
+{
+	php_stream *stream;
+	uint64 start;
+	int bucket;
+
+	if (!hp_file_io_enabled(TSRMLS_C)) {
+		return tw_plain_original_wops->stream_opener(wrapper, path, mode, options, opened_path, context STREAMS_REL_CC TSRMLS_CC);
+	}
+
+	start = cycle_timer();
+	stream = tw_plain_original_wops->stream_opener(wrapper, path, mode, options, opened_path, context STREAMS_REL_CC TSRMLS_CC);
+
+	/* failed opens are not counted, fopen() already warns about them */
+	if (stream == NULL) {
+		return NULL;
+	}
+
+	bucket = hp_file_io_bucket(path TSRMLS_CC);
+	hp_globals.io_buckets[bucket].opens++;
+	hp_globals.io_buckets[bucket].wt += get_us_from_tsc(cycle_timer() - start);
+
+	if (stream->ops != &php_stream_stdio_ops) {
+		return stream;
+	}
+
+	if (hp_globals.io_streams == NULL) {
+		ALLOC_HASHTABLE(hp_globals.io_streams);
+		zend_hash_init(hp_globals.io_streams, 16, NULL, NULL, 0);
+	}
+
+	zend_hash_index_update(hp_globals.io_streams, (zend_uintptr_t)stream, &bucket, sizeof(int), NULL);
+	hp_track_stream_close(TSRMLS_C);
+
+	return stream;
+}
+
+/* Account a stat or access probe of path, for sct/swt and per I/O bucket */
+static void hp_record_stat_probe(const char *path, double wt TSRMLS_DC)
+{
+	int bucket;
+
+	hp_globals.stat_count++;
+	hp_globals.stat_wt += wt;
+	hp_count_path(&hp_globals.stat_paths, path TSRMLS_CC);
+
+	if (hp_file_io_enabled(TSRMLS_C)) {
+		bucket = hp_file_io_bucket(path TSRMLS_CC);
+		hp_globals.io_buckets[bucket].stats++;
+		hp_globals.io_buckets[bucket].wt += wt;
+	}
+}
+
+static int tw_plain_url_stat(php_stream_wrapper *wrapper, TW_STREAM_CONST char *url, int flags, php_stream_statbuf *ssb, php_stream_context *context TSRMLS_DC)
+{
+	uint64 start;
+	int ret;
+
+	if (!hp_count_stats_enabled(TSRMLS_C)) {
+		return tw_plain_original_wops->url_stat(wrapper, url, flags, ssb, context TSRMLS_CC);
+	}
+
+	start = cycle_timer();
+	ret = tw_plain_original_wops->url_stat(wrapper, url, flags, ssb, context TSRMLS_CC);
+	hp_record_stat_probe(url, get_us_from_tsc(cycle_timer() - start) TSRMLS_CC);
+
+	return ret;
+}
+
+/**
+ * file_exists() and the is_readable() family answer plain paths with
+ * access(2) and never reach url_stat, so their internal handlers are
+ * wrapped as well to count them as stat probes.
+ */
+typedef struct tw_access_probe {
+	const char *name;
+	void (*handler)(INTERNAL_FUNCTION_PARAMETERS);
+	void (**original)(INTERNAL_FUNCTION_PARAMETERS);
+} tw_access_probe;
+
+static void hp_access_probe(void (*original)(INTERNAL_FUNCTION_PARAMETERS), INTERNAL_FUNCTION_PARAMETERS)
+{
+	zval **path;
+	uint64 start;
+
+	if (!hp_count_stats_enabled(TSRMLS_C) || ZEND_NUM_ARGS() != 1 ||
+			zend_get_parameters_ex(1, &path) == FAILURE || Z_TYPE_PP(path) != IS_STRING ||
+			php_stream_locate_url_wrapper(Z_STRVAL_PP(path), NULL, 0 TSRMLS_CC) != &php_plain_files_wrapper) {
+		original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+		return;
+	}
+
+	start = cycle_timer();
+	original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+	hp_record_stat_probe(Z_STRVAL_PP(path), get_us_from_tsc(cycle_timer() - start) TSRMLS_CC);
+}
+
+/* One handler per function, each calling the original it replaced */
+#define TW_ACCESS_PROBE(fname) \
+	static void (*tw_##fname##_original)(INTERNAL_FUNCTION_PARAMETERS) = NULL; \
+	static ZEND_NAMED_FUNCTION(tw_##fname##_probe) \
+	{ \
+		hp_access_probe(tw_##fname##_original, INTERNAL_FUNCTION_PARAM_PASSTHRU); \
+	}
+
+TW_ACCESS_PROBE(file_exists)
+TW_ACCESS_PROBE(is_readable)
+TW_ACCESS_PROBE(is_writable)
+TW_ACCESS_PROBE(is_writeable)
+TW_ACCESS_PROBE(is_executable)
+
+static tw_access_probe tw_access_probes[] = {
+	{"file_exists", tw_file_exists_probe, &tw_file_exists_original},
+	{"is_readable", tw_is_readable_probe, &tw_is_readable_original},
+	{"is_writable", tw_is_writable_probe, &tw_is_writable_original},
+	{"is_writeable", tw_is_writeable_probe, &tw_is_writeable_original},
+	{"is_executable", tw_is_executable_probe, &tw_is_executable_original},
+	{NULL, NULL, NULL}
+};
+
+/**
+ * Proxy for zend_resolve_path(), used by include/require and
+ * stream_resolve_include_path() to look up files on the include_path.
+ */
+static char *hp_resolve_path(const char *filename, int filename_len TSRMLS_DC)
+{
+	uint64 start = cycle_timer();
+	char *ret;
+
+	ret = _zend_resolve_path(filename, filename_len TSRMLS_CC);
 
-			idx = tw_span_create("http", 4);
-			tw_span_annotate_string(idx, "url", summary, 0);
-			return idx;
+#ifdef ZTS
+	if (!hp_globals.enabled || (hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_SPANS)) {
+		return ret;
+	}
+#endif
+
+	hp_globals.resolve_count++;
+	hp_globals.resolve_wt += get_us_from_tsc(cycle_timer() - start);
+	/* filenames as given to include, kept apart from the absolute stat paths */
+	hp_count_path(&hp_globals.resolve_paths, filename TSRMLS_CC);
+
+	return ret;
+}
+
+/* Top TIDEWAYS_TOP_COUNTS entries of a name => count table as "count name" pairs, highest first */
+static void hp_annotate_top_counts(HashTable *counts, char *key TSRMLS_DC)
+{
+	char *top[TIDEWAYS_TOP_COUNTS];
+	long top_count[TIDEWAYS_TOP_COUNTS], *count;
+	smart_str buf = {0};
+	HashPosition pos;
+	char *name;
+	uint name_len;
+	ulong num;
+	int i, j, len = 0;
+
+	if (counts == NULL) {
+		return;
+	}
+
+	for (zend_hash_internal_pointer_reset_ex(counts, &pos);
+		zend_hash_get_current_data_ex(counts, (void **)&count, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(counts, &pos)) {
+		zend_hash_get_current_key_ex(counts, &name, &name_len, &num, 0, &pos);
+
+		for (i = len; i > 0 && top_count[i-1] < *count; i--) {
+			if (i < TIDEWAYS_TOP_COUNTS) {
+				top[i] = top[i-1];
+				top_count[i] = top_count[i-1];
+			}
 		}
 
-		zval_ptr_dtor(&retval_ptr);
+		if (i < TIDEWAYS_TOP_COUNTS) {
+			top[i] = name;
+			top_count[i] = *count;
+			len += len < TIDEWAYS_TOP_COUNTS;
+		}
 	}
 
-	efree(params_array);
+	for (j = 0; j < len; j++) {
+		if (j > 0) {
+			smart_str_appendl(&buf, ", ", 2);
+		}
 
-	return -1;
+		smart_str_append_long(&buf, top_count[j]);
+		smart_str_appendc(&buf, ' ');
+		smart_str_appends(&buf, top[j]);
+	}
+
+	smart_str_0(&buf);
+
+	if (buf.c) {
+		tw_span_annotate_string(0, key, buf.c, 1 TSRMLS_CC);
+		smart_str_free(&buf);
+	}
 }
 
-long tw_trace_callback_soap_client_dorequest(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+/**
+ * Wrap the plain files wrapper and the stdio stream ops for the file I/O
+ * buckets and the stat probe counters. Every proxy passes through when it
+ * is not needed, so the hooks stay in place if another extension wrapped
+ * them after us and they cannot be restored without breaking its chain.
+ */
+static void hp_init_plain_files_wrapper(uint32 flags TSRMLS_DC)
 {
-	if (args_len < 2) {
-		return -1;
+	tw_access_probe *probe;
+	zend_function *func;
+
+	if ((flags & TIDEWAYS_FLAGS_FILE_IO) == 0 && (flags & TIDEWAYS_FLAGS_NO_SPANS)) {
+		return;
 	}
 
-	long idx = -1;
-	zval *argument = *(args-args_len+1);
+	if (tw_plain_original_wops == NULL) {
+		tw_plain_original_wops = php_plain_files_wrapper.wops;
+		tw_plain_wops = *tw_plain_original_wops;
+		tw_plain_wops.stream_opener = tw_plain_stream_opener;
+		tw_plain_wops.url_stat = tw_plain_url_stat;
+		php_plain_files_wrapper.wops = &tw_plain_wops;
+	}
 
-	if (Z_TYPE_P(argument) != IS_STRING) {
-		return idx;
+	if ((flags & TIDEWAYS_FLAGS_FILE_IO) && tw_stdio_original_read == NULL) {
+		tw_stdio_original_read = php_stream_stdio_ops.read;
+		tw_stdio_original_write = php_stream_stdio_ops.write;
+		php_stream_stdio_ops.read = tw_plain_stream_read;
+		php_stream_stdio_ops.write = tw_plain_stream_write;
 	}
 
-	idx = tw_span_create("http", 4);
-	tw_span_annotate_string(idx, "url", Z_STRVAL_P(argument), 1);
-	tw_span_annotate_string(idx, "method", "POST", 1);
-	tw_span_annotate_string(idx, "service", "soap", 1);
+	if (flags & TIDEWAYS_FLAGS_NO_SPANS) {
+		return;
+	}
 
-	return idx;
+	for (probe = tw_access_probes; probe->name != NULL; probe++) {
+		if (*probe->original == NULL &&
+				zend_hash_find(CG(function_table), probe->name, strlen(probe->name)+1, (void **)&func) == SUCCESS &&
+				func->type == ZEND_INTERNAL_FUNCTION) {
+			*probe->original = func->internal_function.handler;
+			func->internal_function.handler = probe->handler;
+		}
+	}
 }
 
-long tw_trace_callback_file_get_contents(char *symbol, void **args, int args_len, zval *object TSRMLS_DC)
+static void hp_free_plain_files_wrapper(TSRMLS_D)
 {
-	zval *argument = *(args-args_len);
-	long idx = -1;
+	tw_access_probe *probe;
+	zend_function *func;
 
-	if (Z_TYPE_P(argument) != IS_STRING) {
-		return idx;
+	if (tw_plain_original_wops != NULL && php_plain_files_wrapper.wops == &tw_plain_wops) {
+		php_plain_files_wrapper.wops = tw_plain_original_wops;
+		tw_plain_original_wops = NULL;
 	}
 
-	if (strncmp(Z_STRVAL_P(argument), "http", 4) != 0) {
-		return idx;
+	if (tw_stdio_original_read != NULL &&
+			php_stream_stdio_ops.read == tw_plain_stream_read && php_stream_stdio_ops.write == tw_plain_stream_write) {
+		php_stream_stdio_ops.read = tw_stdio_original_read;
+		php_stream_stdio_ops.write = tw_stdio_original_write;
+		tw_stdio_original_read = NULL;
+		tw_stdio_original_write = NULL;
+	}
+
+	for (probe = tw_access_probes; probe->name != NULL; probe++) {
+		if (*probe->original != NULL &&
+				zend_hash_find(CG(function_table), probe->name, strlen(probe->name)+1, (void **)&func) == SUCCESS &&
+				func->internal_function.handler == probe->handler) {
+			func->internal_function.handler = *probe->original;
+			*probe->original = NULL;
+		}
 	}
+}
+
+static void hp_init_file_io(TSRMLS_D)
+{
+	const char *p = INI_STR("tideways.file_io_prefixes"), *end;
+	int len;
 
-	idx = tw_span_create("http", 4);
-	tw_span_annotate_string(idx, "url", Z_STRVAL_P(argument), 1);
+	hp_globals.io_buckets = NULL;
+	hp_globals.io_buckets_len = 0;
+	hp_globals.io_streams = NULL;
 
-	return idx;
+	if ((hp_globals.tideways_flags & TIDEWAYS_FLAGS_FILE_IO) == 0) {
+		return;
+	}
+
+	/* at most as many prefixes as commas, plus "other" */
+	for (end = p, len = 2; end && *end; end++) {
+		len += *end == ',';
+	}
+
+	hp_globals.io_buckets = ecalloc(len, sizeof(tw_io_bucket));
+
+	while (p && *p) {
+		p += strspn(p, ", \t");
+		end = p + strcspn(p, ", \t");
+
+		if (end > p) {
+			hp_globals.io_buckets[hp_globals.io_buckets_len].prefix = estrndup(p, end - p);
+			hp_globals.io_buckets[hp_globals.io_buckets_len].prefix_len = end - p;
+			hp_globals.io_buckets_len++;
+		}
+
+		p = end;
+	}
+
+	hp_globals.io_buckets[hp_globals.io_buckets_len].prefix = estrdup("other");
+	hp_globals.io_buckets[hp_globals.io_buckets_len].prefix_len = 0;
+	hp_globals.io_buckets_len++;
+}
+
+static void hp_annotate_file_io(TSRMLS_D)
+{
+	tw_io_bucket *bucket;
+	char *key, *value;
+	int i;
+
+	for (i = 0; i < hp_globals.io_buckets_len; i++) {
+		bucket = &hp_globals.io_buckets[i];
+
+		if (bucket->opens == 0 && bucket->stats == 0 && bucket->reads == 0 && bucket->writes == 0) {
+			continue;
+		}
+
+		spprintf(&key, 0, "io:%s", bucket->prefix);
+		spprintf(&value, 0, "open=%ld read=%ld write=%ld stat=%ld bytes_read=%ld bytes_written=%ld wt=%ld",
+			bucket->opens, bucket->reads, bucket->writes, bucket->stats, bucket->bytes_read, bucket->bytes_written, (long)bucket->wt);
+
+		tw_span_annotate_string(0, key, value, 1 TSRMLS_CC);
+
+		efree(key);
+		efree(value);
+	}
+}
+
+static void hp_clean_file_io(TSRMLS_D)
+{
+	int i;
+
+	if (hp_globals.io_streams) {
+		zend_hash_destroy(hp_globals.io_streams);
+		FREE_HASHTABLE(hp_globals.io_streams);
+		hp_globals.io_streams = NULL;
+	}
+
+	for (i = 0; i < hp_globals.io_buckets_len; i++) {
+		efree(hp_globals.io_buckets[i].prefix);
+	}
+
+	if (hp_globals.io_buckets) {
+		efree(hp_globals.io_buckets);
+		hp_globals.io_buckets = NULL;
+	}
+
+	hp_globals.io_buckets_len = 0;
 }
 
 /**
@@ -1537,6 +3822,9 @@ PHP_RINIT_FUNCTION(tideways)
 	hp_globals.prepend_overwritten = 0;
 	hp_globals.backtrace = NULL;
 	hp_globals.exception = NULL;
+	hp_globals.trace_id[0] = '\0';
+
+	hp_read_incoming_trace(TSRMLS_C);
 
 	if (INI_INT("tideways.auto_prepend_library") == 0) {
 		return SUCCESS;
@@ -1568,6 +3856,7 @@ PHP_RINIT_FUNCTION(tideways)
 PHP_RSHUTDOWN_FUNCTION(tideways)
 {
 	hp_end(TSRMLS_C);
+	hp_free_curl_restored(TSRMLS_C);
 
 	if (hp_globals.prepend_overwritten == 1) {
 		efree(PG(auto_prepend_file));
@@ -1599,7 +3888,16 @@ PHP_MINFO_FUNCTION(tideways)
 	php_info_print_table_row(2, "Tideways Collect Mode (tideways.collect)", INI_STR("tideways.collect"));
 	php_info_print_table_row(2, "Tideways Monitoring Mode (tideways.monitor)", INI_STR("tideways.monitor"));
 	php_info_print_table_row(2, "Allowed Distributed Tracing Hosts (tideways.distributed_tracing_hosts)", INI_STR("tideways.distributed_tracing_hosts"));
+	php_info_print_table_row(2, "Span Watch Definitions (tideways.span_watch_file)", INI_STR("tideways.span_watch_file"));
+	php_info_print_table_row(2, "Callback Packs (tideways.callback_packs)", INI_STR("tideways.callback_packs"));
+	php_info_print_table_row(2, "File I/O Prefixes (tideways.file_io_prefixes)", INI_STR("tideways.file_io_prefixes"));
+	php_info_print_table_row(2, "Collapse Numeric URL Segments (tideways.url_collapse_numeric)", INI_INT("tideways.url_collapse_numeric") ? "Yes": "No");
 	php_info_print_table_row(2, "Load PHP Library (tideways.auto_prepend_library)", INI_INT("tideways.auto_prepend_library") ? "Yes": "No");
+#if defined(PHP_TIDEWAYS_HAVE_CURL) && PHP_VERSION_ID > 50399
+	php_info_print_table_row(2, "libcurl Support", "Yes");
+#else
+	php_info_print_table_row(2, "libcurl Support", "No");
+#endif
 
 	extension_dir  = INI_STR("extension_dir");
 	profiler_file_len = strlen(extension_dir) + strlen("Tideways.php") + 2;
@@ -1633,6 +3931,16 @@ static void hp_register_constants(INIT_FUNC_ARGS)
 	REGISTER_LONG_CONSTANT("TIDEWAYS_FLAGS_NO_COMPILE", TIDEWAYS_FLAGS_NO_COMPILE, CONST_CS | CONST_PERSISTENT);
 	REGISTER_LONG_CONSTANT("TIDEWAYS_FLAGS_NO_SPANS", TIDEWAYS_FLAGS_NO_SPANS, CONST_CS | CONST_PERSISTENT);
 	REGISTER_LONG_CONSTANT("TIDEWAYS_FLAGS_NO_HIERACHICAL", TIDEWAYS_FLAGS_NO_HIERACHICAL, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("TIDEWAYS_FLAGS_FILE_IO", TIDEWAYS_FLAGS_FILE_IO, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("TIDEWAYS_FLAGS_AUTOLOAD", TIDEWAYS_FLAGS_AUTOLOAD, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("TIDEWAYS_FLAGS_RUN_INIT", TIDEWAYS_FLAGS_RUN_INIT, CONST_CS | CONST_PERSISTENT);
+
+	/* curl spans read timings and inject trace headers through libcurl */
+#if defined(PHP_TIDEWAYS_HAVE_CURL) && PHP_VERSION_ID > 50399
+	REGISTER_LONG_CONSTANT("TIDEWAYS_HAVE_CURL", 1, CONST_CS | CONST_PERSISTENT);
+#else
+	REGISTER_LONG_CONSTANT("TIDEWAYS_HAVE_CURL", 0, CONST_CS | CONST_PERSISTENT);
+#endif
 }
 
 /**
@@ -1679,9 +3987,9 @@ EMPTY_SWITCH_DEFAULT_CASE()
  *
  * @author mpal
  */
-static void hp_parse_options_from_arg(zval *args)
+static void hp_parse_options_from_arg(zval *args TSRMLS_DC)
 {
-	hp_clean_profiler_options_state();
+	hp_clean_profiler_options_state(TSRMLS_C);
 
 	if (args == NULL) {
 		return;
@@ -1715,7 +4023,7 @@ static void hp_parse_options_from_arg(zval *args)
 	}
 }
 
-static void hp_exception_function_clear() {
+static void hp_exception_function_clear(TSRMLS_D) {
 	if (hp_globals.exception_function != NULL) {
 		hp_string_clean(hp_globals.exception_function);
 		efree(hp_globals.exception_function);
@@ -1727,7 +4035,7 @@ static void hp_exception_function_clear() {
 	}
 }
 
-static void hp_transaction_function_clear() {
+static void hp_transaction_function_clear(TSRMLS_D) {
 	if (hp_globals.transaction_function) {
 		hp_string_clean(hp_globals.transaction_function);
 		efree(hp_globals.transaction_function);
@@ -1793,73 +4101,205 @@ static inline int hp_function_map_filter_collision(hp_function_map *map, uint8 h
 	return map->filter[INDEX_2_BYTE(hash)] & mask;
 }
 
-void hp_init_trace_callbacks(TSRMLS_D)
+static void hp_register_request_trace_callback(char *function_name, int len, tw_trace_callback cb TSRMLS_DC)
 {
-	tw_trace_callback cb;
+	/* cached resolutions may miss the new callback, drop them before the next call */
+	hp_globals.resolved_stale = 1;
+
+	if (hp_globals.trace_callbacks == NULL) {
+		ALLOC_HASHTABLE(hp_globals.trace_callbacks);
+		zend_hash_init(hp_globals.trace_callbacks, 32, NULL, NULL, 0);
+	}
+
+	zend_hash_update(hp_globals.trace_callbacks, function_name, len+1, &cb, sizeof(tw_trace_callback*), NULL);
+}
+
+static void hp_register_builtin_trace_callback(char *function_name, int len, tw_trace_callback cb, tw_trace_end_callback end, uint32 pack TSRMLS_DC)
+{
+	tw_builtin_trace_callback entry;
+
+	if ((tw_builtin_packs & pack) == 0) {
+		return;
+	}
+
+	entry.cb = cb;
+	entry.end = end;
+	entry.pack = pack;
+
+	zend_hash_update(tw_builtin_trace_callbacks, function_name, len, &entry, sizeof(tw_builtin_trace_callback), NULL);
+}
+
+/**
+ * Lookup the callback for a function, request registrations take precedence
+ * over the built-in callbacks of the packs enabled for this request.
+ */
+static inline int hp_find_trace_callback(char *function_name, int len, tw_resolved_watch *watch TSRMLS_DC)
+{
+	tw_trace_callback *callback;
+	tw_builtin_trace_callback *entry;
+
+	if (hp_globals.trace_callbacks != NULL &&
+			zend_hash_find(hp_globals.trace_callbacks, function_name, len, (void **)&callback) == SUCCESS) {
+		watch->cb = *callback;
+		return SUCCESS;
+	}
+
+	if (zend_hash_find(tw_builtin_trace_callbacks, function_name, len, (void **)&entry) == SUCCESS &&
+			(entry->pack & hp_globals.trace_packs) != 0) {
+		watch->cb = entry->cb;
+		watch->end = entry->end;
+		return SUCCESS;
+	}
+
+	return FAILURE;
+}
 
+/**
+ * Resolve the enabled callback packs from a comma separated list of pack
+ * names and the framework name. Without an explicit list the generic packs
+ * plus the packs of the framework are enabled, and all packs when the
+ * framework is not set or unknown.
+ */
+static uint32 hp_resolve_callback_packs(const char *packs, const char *framework)
+{
+	char buf[256];
+	char *token, *last;
+	uint32 result = TW_PACK_PHP, framework_packs = 0;
+	int i;
+
+	if (framework != NULL && framework[0] != '\0') {
+		for (i = 0; tw_framework_packs[i].name != NULL; i++) {
+			if (strncasecmp(framework, tw_framework_packs[i].name, strlen(tw_framework_packs[i].name)) == 0) {
+				framework_packs = tw_framework_packs[i].packs;
+				break;
+			}
+		}
+	}
+
+	if (packs == NULL || packs[0] == '\0') {
+		return framework_packs == 0 ? TW_PACK_ALL : (TW_PACK_GENERIC | framework_packs);
+	}
+
+	strlcpy(buf, packs, sizeof(buf));
+
+	for (token = php_strtok_r(buf, ", ", &last); token != NULL; token = php_strtok_r(NULL, ", ", &last)) {
+		for (i = 0; tw_callback_packs[i].name != NULL; i++) {
+			if (strcasecmp(token, tw_callback_packs[i].name) == 0) {
+				result |= tw_callback_packs[i].packs;
+				break;
+			}
+		}
+	}
+
+	return result | framework_packs;
+}
+
+void hp_init_trace_callbacks(TSRMLS_D)
+{
 	if ((hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_SPANS) > 0) {
 		return;
 	}
 
 	hp_globals.trace_callbacks = NULL;
 	hp_globals.trace_watch_callbacks = NULL;
+	hp_globals.trace_watch_specs = NULL;
 	hp_globals.span_cache = NULL;
-
-	ALLOC_HASHTABLE(hp_globals.trace_callbacks);
-	zend_hash_init(hp_globals.trace_callbacks, 255, NULL, NULL, 0);
+	hp_globals.url_cache = NULL;
+	hp_globals.curl_multi_transfers = NULL;
+	hp_globals.curl_traces = NULL;
+	hp_globals.mongo_cursors = NULL;
+	hp_globals.class_spans = NULL;
+	hp_globals.object_spans = NULL;
+	hp_globals.span_aggregates = NULL;
+	hp_globals.http_streams = NULL;
+	hp_globals.tracing_hosts = hp_compile_tracing_hosts(INI_STR("tideways.distributed_tracing_hosts"));
+	hp_globals.url_collapse_numeric = INI_INT("tideways.url_collapse_numeric");
 
 	ALLOC_HASHTABLE(hp_globals.span_cache);
 	zend_hash_init(hp_globals.span_cache, 255, NULL, NULL, 0);
 
-	cb = tw_trace_callback_file_get_contents;
-	register_trace_callback("file_get_contents", cb);
+	hp_init_file_io(TSRMLS_C);
+
+	/* Packs missing from the built-in table at startup cannot be enabled per request */
+	hp_globals.trace_packs = hp_resolve_callback_packs(INI_STR("tideways.callback_packs"), INI_STR("tideways.framework"));
+
+	hp_globals.gc_runs = GC_G(gc_runs);
+	hp_globals.gc_collected = GC_G(collected);
+	hp_globals.compile_count = 0;
+	hp_globals.compile_wt = 0;
+	hp_globals.compile_hits = 0;
+	hp_globals.eval_count = 0;
+	hp_globals.eval_wt = 0;
+	hp_globals.compile_top = NULL;
+	hp_globals.compile_top_len = 0;
+	hp_globals.autoload_span = -1;
+	hp_globals.autoload_depth = 0;
+	hp_globals.autoload_compile_wt = 0;
+	hp_globals.autoload_top = NULL;
+	hp_globals.autoload_top_len = 0;
+	hp_globals.stat_count = 0;
+	hp_globals.stat_wt = 0;
+	hp_globals.resolve_count = 0;
+	hp_globals.resolve_wt = 0;
+	hp_globals.stat_paths = NULL;
+	hp_globals.resolve_paths = NULL;
+}
+
+/**
+ * Build the table of built-in trace callbacks. Called once in MINIT, the
+ * table is persistent and only read during requests. Only callbacks of packs
+ * selected at startup are registered, see hp_resolve_callback_packs().
+ */
+static void hp_init_builtin_trace_callbacks(TSRMLS_D)
+{
+	tw_trace_callback cb;
+	uint32 pack;
+
+	tw_builtin_trace_callbacks = pemalloc(sizeof(HashTable), 1);
+	zend_hash_init(tw_builtin_trace_callbacks, 256, NULL, NULL, 1);
 
+	pack = TW_PACK_PHP;
 	cb = tw_trace_callback_php_call;
 	register_trace_callback("session_start", cb);
-	// Symfony
-	register_trace_callback("Symfony\\Component\\HttpKernel\\Kernel::boot", cb);
-	register_trace_callback("Symfony\\Component\\EventDispatcher\\ContainerAwareEventDispatcher::lazyLoad", cb);
-	// Wordpress
-	register_trace_callback("get_sidebar", cb);
-	register_trace_callback("get_header", cb);
-	register_trace_callback("get_footer", cb);
-	register_trace_callback("load_textdomain", cb);
-	register_trace_callback("setup_theme", cb);
-	// Doctrine
-	register_trace_callback("Doctrine\\ORM\\EntityManager::flush", cb);
-	register_trace_callback("Doctrine\\ODM\\CouchDB\\DocumentManager::flush", cb);
-	// Magento
-	register_trace_callback("Mage_Core_Model_App::_initModules", cb);
-	register_trace_callback("Mage_Core_Model_Config::loadModules", cb);
-	register_trace_callback("Mage_Core_Model_Config::loadDb", cb);
-	// Smarty&Twig Compiler
-	register_trace_callback("Smarty_Internal_TemplateCompilerBase::compileTemplate", cb);
-	register_trace_callback("Twig_Environment::compileSource", cb);
-	// Shopware Assets (very special, do we really need it?)
-	register_trace_callback("JSMin::minify", cb);
-	register_trace_callback("Less_Parser::getCss", cb);
-	// Laravel (4+5)
-	register_trace_callback("Illuminate\\Foundation\\Application::boot", cb);
-	register_trace_callback("Illuminate\\Foundation\\Application::dispatch", cb);
-	// Silex
-	register_trace_callback("Silex\\Application::mount", cb);
 
-	cb = tw_trace_callback_doctrine_persister;
-	register_trace_callback("Doctrine\\ORM\\Persisters\\BasicEntityPersister::load", cb);
-	register_trace_callback("Doctrine\\ORM\\Persisters\\BasicEntityPersister::loadAll", cb);
-	register_trace_callback("Doctrine\\ORM\\Persisters\\Entity\\BasicEntityPersister::load", cb);
-	register_trace_callback("Doctrine\\ORM\\Persisters\\Entity\\BasicEntityPersister::loadAll", cb);
-
-	cb = tw_trace_callback_doctrine_query;
-	register_trace_callback("Doctrine\\ORM\\AbstractQuery::execute", cb);
+	cb = tw_trace_callback_fastcgi_finish_request;
+	register_trace_callback("fastcgi_finish_request", cb);
 
-	cb = tw_trace_callback_doctrine_couchdb_request;
-	register_trace_callback("Doctrine\\CouchDB\\HTTP\\SocketClient::request", cb);
-	register_trace_callback("Doctrine\\CouchDB\\HTTP\\StreamClient::request", cb);
+	cb = tw_trace_callback_autoload;
+	register_trace_callback_with_end("spl_autoload_call", cb, tw_trace_callback_autoload_end);
+	register_trace_callback_with_end("__autoload", cb, tw_trace_callback_autoload_end);
 
+	pack = TW_PACK_HTTP;
 	cb = tw_trace_callback_curl_exec;
-	register_trace_callback("curl_exec", cb);
+	register_trace_callback_with_end("curl_exec", cb, tw_trace_callback_curl_exec_end);
+
+#if defined(PHP_TIDEWAYS_HAVE_CURL) && PHP_VERSION_ID > 50399
+	cb = tw_trace_callback_curl_init;
+	register_trace_callback_with_end("curl_init", cb, tw_trace_callback_curl_init_end);
+	register_trace_callback_with_end("curl_copy_handle", cb, tw_trace_callback_curl_copy_handle_end);
+
+	cb = tw_trace_callback_curl_setopt;
+	register_trace_callback("curl_setopt", cb);
+	register_trace_callback("curl_setopt_array", cb);
+	register_trace_callback("curl_reset", cb);
+
+	cb = tw_trace_callback_curl_multi_add_handle;
+	register_trace_callback("curl_multi_add_handle", cb);
 
+	cb = tw_trace_callback_curl_multi_exec;
+	register_trace_callback("curl_multi_exec", cb);
+
+	cb = tw_trace_callback_curl_multi_remove_handle;
+	register_trace_callback("curl_multi_remove_handle", cb);
+
+	cb = tw_trace_callback_curl_multi_close;
+	register_trace_callback("curl_multi_close", cb);
+#endif
+
+	cb = tw_trace_callback_soap_client_dorequest;
+	register_trace_callback("SoapClient::__doRequest", cb);
+
+	pack = TW_PACK_SQL;
 	cb = tw_trace_callback_sql_functions;
 	register_trace_callback("PDO::exec", cb);
 	register_trace_callback("PDO::query", cb);
@@ -1888,52 +4328,7 @@ void hp_init_trace_callbacks(TSRMLS_D)
 	cb = tw_trace_callback_pgsql_execute;
 	register_trace_callback("pg_execute", cb);
 
-	cb = tw_trace_callback_event_dispatchers;
-	register_trace_callback("Doctrine\\Common\\EventManager::dispatchEvent", cb);
-	register_trace_callback("Enlight_Event_EventManager::filter", cb);
-	register_trace_callback("Enlight_Event_EventManager::notify", cb);
-	register_trace_callback("Enlight_Event_EventManager::notifyUntil", cb);
-	register_trace_callback("Zend\\EventManager\\EventManager::trigger", cb);
-	register_trace_callback("do_action", cb);
-	register_trace_callback("drupal_alter", cb);
-	register_trace_callback("Mage::dispatchEvent", cb);
-	register_trace_callback("Symfony\\Component\\EventDispatcher\\EventDispatcher::dispatch", cb);
-	register_trace_callback("Illuminate\\Events\\Dispatcher::fire", cb);
-
-	cb = tw_trace_callback_twig_template;
-	register_trace_callback("Twig_Template::render", cb);
-	register_trace_callback("Twig_Template::display", cb);
-
-	cb = tw_trace_callback_smarty3_template;
-	register_trace_callback("Smarty_Internal_TemplateBase::fetch", cb);
-
-	cb = tw_trace_callback_fastcgi_finish_request;
-	register_trace_callback("fastcgi_finish_request", cb);
-
-	cb = tw_trace_callback_soap_client_dorequest;
-	register_trace_callback("SoapClient::__doRequest", cb);
-
-	cb = tw_trace_callback_magento_block;
-	register_trace_callback("Mage_Core_Block_Abstract::toHtml", cb);
-
-	cb = tw_trace_callback_view_engine;
-	register_trace_callback("Zend_View_Abstract::render", cb);
-	register_trace_callback("Illuminate\\View\\Engines\\CompilerEngine::get", cb);
-	register_trace_callback("Smarty::fetch", cb);
-	register_trace_callback("load_template", cb);
-
-	cb = tw_trace_callback_zend1_dispatcher_families_tx;
-	register_trace_callback("Enlight_Controller_Action::dispatch", cb);
-	register_trace_callback("Mage_Core_Controller_Varien_Action::dispatch", cb);
-	register_trace_callback("Zend_Controller_Action::dispatch", cb);
-	register_trace_callback("Illuminate\\Routing\\Controller::callAction", cb);
-
-	cb = tw_trace_callback_symfony_resolve_arguments_tx;
-	register_trace_callback("Symfony\\Component\\HttpKernel\\Controller\\ControllerResolver::getArguments", cb);
-
-	cb = tw_trace_callback_oxid_tx;
-	register_trace_callback("oxShopControl::_process", cb);
-
+	pack = TW_PACK_CACHE;
 	// Different versions of Memcache Extension have either MemcachePool or Memcache class, @todo investigate
 	cb = tw_trace_callback_memcache;
 	register_trace_callback("MemcachePool::get", cb);
@@ -1951,6 +4346,39 @@ void hp_init_trace_callbacks(TSRMLS_D)
 	register_trace_callback("Memcache::increment", cb);
 	register_trace_callback("Memcache::decrement", cb);
 
+	cb = tw_trace_callback_predis_call;
+	register_trace_callback("Predis\\Client::__call", cb);
+
+	{
+		const char *redis[] = {
+			"get", "set", "setex", "setnx", "del", "delete", "unlink", "exists", "incr", "incrBy", "decr", "decrBy",
+			"expire", "ttl", "mget", "mset", "getSet", "hGet", "hSet", "hMGet", "hMSet", "hGetAll", "hDel", "hIncrBy",
+			"lPush", "rPush", "lPop", "rPop", "lRange", "lLen", "sAdd", "sRem", "sMembers", "sIsMember",
+			"zAdd", "zRem", "zRange", "zRevRange", "zRangeByScore", "zScore", "publish", "eval", "evalSha", "exec",
+			NULL
+		};
+		const char *memcached[] = {
+			"get", "getByKey", "getMulti", "getMultiByKey", "set", "setByKey", "setMulti", "add", "replace", "append",
+			"prepend", "cas", "touch", "delete", "deleteMulti", "increment", "decrement", "flush",
+			NULL
+		};
+		char name[64];
+		int i;
+
+		cb = tw_trace_callback_cache_command;
+
+		for (i = 0; redis[i] != NULL; i++) {
+			snprintf(name, sizeof(name), "Redis::%s", redis[i]);
+			hp_register_builtin_trace_callback(name, strlen(name)+1, cb, tw_trace_callback_cache_command_end, pack TSRMLS_CC);
+		}
+
+		for (i = 0; memcached[i] != NULL; i++) {
+			snprintf(name, sizeof(name), "Memcached::%s", memcached[i]);
+			hp_register_builtin_trace_callback(name, strlen(name)+1, cb, tw_trace_callback_cache_command_end, pack TSRMLS_CC);
+		}
+	}
+
+	pack = TW_PACK_QUEUE;
 	cb = tw_trace_callback_pheanstalk;
 	register_trace_callback("Pheanstalk_Pheanstalk::put", cb);
 	register_trace_callback("Pheanstalk\\Pheanstalk::put", cb);
@@ -1958,6 +4386,7 @@ void hp_init_trace_callbacks(TSRMLS_D)
 	cb = tw_trace_callback_phpampqlib;
 	register_trace_callback("PhpAmqpLib\\Channel\\AMQPChannel::basic_publish", cb);
 
+	pack = TW_PACK_MONGO;
 	cb = tw_trace_callback_mongo_collection;
 	register_trace_callback("MongoCollection::find", cb);
 	register_trace_callback("MongoCollection::findOne", cb);
@@ -1985,13 +4414,147 @@ void hp_init_trace_callbacks(TSRMLS_D)
 	register_trace_callback("MongoCursor::doQuery", cb);
 	register_trace_callback("MongoCursor::count", cb);
 
-	cb = tw_trace_callback_predis_call;
-	register_trace_callback("Predis\\Client::__call", cb);
+	cb = tw_trace_callback_mongodb_manager;
+	register_trace_callback("MongoDB\\Driver\\Manager::executeQuery", cb);
+	register_trace_callback("MongoDB\\Driver\\Manager::executeCommand", cb);
+	register_trace_callback("MongoDB\\Driver\\Manager::executeBulkWrite", cb);
 
-	hp_globals.gc_runs = GC_G(gc_runs);
-	hp_globals.gc_collected = GC_G(collected);
-	hp_globals.compile_count = 0;
-	hp_globals.compile_wt = 0;
+	pack = TW_PACK_TWIG;
+	cb = tw_trace_callback_php_call;
+	register_trace_callback("Twig_Environment::compileSource", cb);
+
+	cb = tw_trace_callback_twig_template;
+	register_trace_callback("Twig_Template::render", cb);
+	register_trace_callback("Twig_Template::display", cb);
+
+	pack = TW_PACK_SMARTY;
+	cb = tw_trace_callback_php_call;
+	register_trace_callback("Smarty_Internal_TemplateCompilerBase::compileTemplate", cb);
+
+	cb = tw_trace_callback_smarty3_template;
+	register_trace_callback("Smarty_Internal_TemplateBase::fetch", cb);
+
+	cb = tw_trace_callback_view_engine;
+	register_trace_callback("Smarty::fetch", cb);
+
+	pack = TW_PACK_SYMFONY;
+	cb = tw_trace_callback_php_call;
+	register_trace_callback("Symfony\\Component\\HttpKernel\\Kernel::boot", cb);
+	register_trace_callback("Symfony\\Component\\EventDispatcher\\ContainerAwareEventDispatcher::lazyLoad", cb);
+	// Silex
+	register_trace_callback("Silex\\Application::mount", cb);
+
+	cb = tw_trace_callback_event_dispatchers;
+	register_trace_callback("Symfony\\Component\\EventDispatcher\\EventDispatcher::dispatch", cb);
+
+	cb = tw_trace_callback_symfony_resolve_arguments_tx;
+	register_trace_callback("Symfony\\Component\\HttpKernel\\Controller\\ControllerResolver::getArguments", cb);
+
+	pack = TW_PACK_DOCTRINE;
+	cb = tw_trace_callback_php_call;
+	register_trace_callback("Doctrine\\ORM\\EntityManager::flush", cb);
+	register_trace_callback("Doctrine\\ODM\\CouchDB\\DocumentManager::flush", cb);
+
+	cb = tw_trace_callback_doctrine_persister;
+	register_trace_callback("Doctrine\\ORM\\Persisters\\BasicEntityPersister::load", cb);
+	register_trace_callback("Doctrine\\ORM\\Persisters\\BasicEntityPersister::loadAll", cb);
+	register_trace_callback("Doctrine\\ORM\\Persisters\\Entity\\BasicEntityPersister::load", cb);
+	register_trace_callback("Doctrine\\ORM\\Persisters\\Entity\\BasicEntityPersister::loadAll", cb);
+
+	cb = tw_trace_callback_doctrine_query;
+	register_trace_callback("Doctrine\\ORM\\AbstractQuery::execute", cb);
+
+	cb = tw_trace_callback_doctrine_couchdb_request;
+	register_trace_callback("Doctrine\\CouchDB\\HTTP\\SocketClient::request", cb);
+	register_trace_callback("Doctrine\\CouchDB\\HTTP\\StreamClient::request", cb);
+
+	cb = tw_trace_callback_event_dispatchers;
+	register_trace_callback("Doctrine\\Common\\EventManager::dispatchEvent", cb);
+
+	pack = TW_PACK_LARAVEL;
+	cb = tw_trace_callback_php_call;
+	// Laravel (4+5)
+	register_trace_callback("Illuminate\\Foundation\\Application::boot", cb);
+	register_trace_callback("Illuminate\\Foundation\\Application::dispatch", cb);
+
+	cb = tw_trace_callback_event_dispatchers;
+	register_trace_callback("Illuminate\\Events\\Dispatcher::fire", cb);
+
+	cb = tw_trace_callback_view_engine;
+	register_trace_callback("Illuminate\\View\\Engines\\CompilerEngine::get", cb);
+
+	cb = tw_trace_callback_zend1_dispatcher_families_tx;
+	register_trace_callback("Illuminate\\Routing\\Controller::callAction", cb);
+
+	pack = TW_PACK_MAGENTO;
+	cb = tw_trace_callback_php_call;
+	register_trace_callback("Mage_Core_Model_App::_initModules", cb);
+	register_trace_callback("Mage_Core_Model_Config::loadModules", cb);
+	register_trace_callback("Mage_Core_Model_Config::loadDb", cb);
+
+	cb = tw_trace_callback_event_dispatchers;
+	register_trace_callback("Mage::dispatchEvent", cb);
+
+	cb = tw_trace_callback_magento_block;
+	register_trace_callback("Mage_Core_Block_Abstract::toHtml", cb);
+
+	cb = tw_trace_callback_zend1_dispatcher_families_tx;
+	register_trace_callback("Mage_Core_Controller_Varien_Action::dispatch", cb);
+
+	pack = TW_PACK_SHOPWARE;
+	cb = tw_trace_callback_php_call;
+	// Shopware Assets (very special, do we really need it?)
+	register_trace_callback("JSMin::minify", cb);
+	register_trace_callback("Less_Parser::getCss", cb);
+
+	cb = tw_trace_callback_event_dispatchers;
+	register_trace_callback("Enlight_Event_EventManager::filter", cb);
+	register_trace_callback("Enlight_Event_EventManager::notify", cb);
+	register_trace_callback("Enlight_Event_EventManager::notifyUntil", cb);
+
+	cb = tw_trace_callback_zend1_dispatcher_families_tx;
+	register_trace_callback("Enlight_Controller_Action::dispatch", cb);
+
+	pack = TW_PACK_ZEND;
+	cb = tw_trace_callback_event_dispatchers;
+	register_trace_callback("Zend\\EventManager\\EventManager::trigger", cb);
+
+	cb = tw_trace_callback_view_engine;
+	register_trace_callback("Zend_View_Abstract::render", cb);
+
+	cb = tw_trace_callback_zend1_dispatcher_families_tx;
+	register_trace_callback("Zend_Controller_Action::dispatch", cb);
+
+	pack = TW_PACK_WORDPRESS;
+	cb = tw_trace_callback_php_call;
+	register_trace_callback("get_sidebar", cb);
+	register_trace_callback("get_header", cb);
+	register_trace_callback("get_footer", cb);
+	register_trace_callback("load_textdomain", cb);
+	register_trace_callback("setup_theme", cb);
+
+	cb = tw_trace_callback_event_dispatchers;
+	register_trace_callback("do_action", cb);
+
+	cb = tw_trace_callback_view_engine;
+	register_trace_callback("load_template", cb);
+
+	pack = TW_PACK_OXID;
+	cb = tw_trace_callback_oxid_tx;
+	register_trace_callback("oxShopControl::_process", cb);
+
+	pack = TW_PACK_DRUPAL;
+	cb = tw_trace_callback_event_dispatchers;
+	register_trace_callback("drupal_alter", cb);
+}
+
+static void hp_free_builtin_trace_callbacks(TSRMLS_D)
+{
+	if (tw_builtin_trace_callbacks) {
+		zend_hash_destroy(tw_builtin_trace_callbacks);
+		pefree(tw_builtin_trace_callbacks, 1);
+		tw_builtin_trace_callbacks = NULL;
+	}
 }
 
 
@@ -2022,7 +4585,7 @@ void hp_init_profiler_state(TSRMLS_D)
 	array_init(hp_globals.spans);
 
 	/* Set up filter of functions which may be ignored during profiling */
-	hp_transaction_name_clear();
+	hp_transaction_name_clear(TSRMLS_C);
 
 	hp_init_trace_callbacks(TSRMLS_C);
 }
@@ -2047,13 +4610,13 @@ void hp_clean_profiler_state(TSRMLS_D)
 	hp_globals.entries = NULL;
 	hp_globals.ever_enabled = 0;
 
-	hp_clean_profiler_options_state();
+	hp_clean_profiler_options_state(TSRMLS_C);
 
 	hp_function_map_clear(hp_globals.filtered_functions);
 	hp_globals.filtered_functions = NULL;
 }
 
-static void hp_transaction_name_clear()
+static void hp_transaction_name_clear(TSRMLS_D)
 {
 	if (hp_globals.transaction_name) {
 		hp_string_clean(hp_globals.transaction_name);
@@ -2062,14 +4625,14 @@ static void hp_transaction_name_clear()
 	}
 }
 
-static void hp_clean_profiler_options_state()
+static void hp_clean_profiler_options_state(TSRMLS_D)
 {
 	hp_function_map_clear(hp_globals.filtered_functions);
 	hp_globals.filtered_functions = NULL;
 
-	hp_exception_function_clear();
-	hp_transaction_function_clear();
-	hp_transaction_name_clear();
+	hp_exception_function_clear(TSRMLS_C);
+	hp_transaction_function_clear(TSRMLS_C);
+	hp_transaction_name_clear(TSRMLS_C);
 
 	if (hp_globals.trace_callbacks) {
 		zend_hash_destroy(hp_globals.trace_callbacks);
@@ -2083,11 +4646,97 @@ static void hp_clean_profiler_options_state()
 		hp_globals.trace_watch_callbacks = NULL;
 	}
 
+	if (hp_globals.trace_watch_specs) {
+		zend_hash_destroy(hp_globals.trace_watch_specs);
+		FREE_HASHTABLE(hp_globals.trace_watch_specs);
+		hp_globals.trace_watch_specs = NULL;
+	}
+
+	hp_clean_resolved_watches(TSRMLS_C);
+	zend_llist_clean(&hp_globals.watch_patterns);
+	hp_globals.resolved_stale = 0;
+
 	if (hp_globals.span_cache) {
 		zend_hash_destroy(hp_globals.span_cache);
 		FREE_HASHTABLE(hp_globals.span_cache);
 		hp_globals.span_cache = NULL;
 	}
+
+	if (hp_globals.url_cache) {
+		zend_hash_destroy(hp_globals.url_cache);
+		FREE_HASHTABLE(hp_globals.url_cache);
+		hp_globals.url_cache = NULL;
+	}
+
+	if (hp_globals.curl_multi_transfers) {
+		zend_hash_destroy(hp_globals.curl_multi_transfers);
+		FREE_HASHTABLE(hp_globals.curl_multi_transfers);
+		hp_globals.curl_multi_transfers = NULL;
+	}
+
+	hp_clean_curl_traces(TSRMLS_C);
+	hp_clean_object_hooks(TSRMLS_C);
+
+	if (hp_globals.mongo_cursors) {
+		zend_hash_destroy(hp_globals.mongo_cursors);
+		FREE_HASHTABLE(hp_globals.mongo_cursors);
+		hp_globals.mongo_cursors = NULL;
+	}
+
+	if (hp_globals.class_spans) {
+		zend_hash_destroy(hp_globals.class_spans);
+		FREE_HASHTABLE(hp_globals.class_spans);
+		hp_globals.class_spans = NULL;
+	}
+
+	if (hp_globals.object_spans) {
+		zend_hash_destroy(hp_globals.object_spans);
+		FREE_HASHTABLE(hp_globals.object_spans);
+		hp_globals.object_spans = NULL;
+	}
+
+	if (hp_globals.span_aggregates) {
+		zend_hash_destroy(hp_globals.span_aggregates);
+		FREE_HASHTABLE(hp_globals.span_aggregates);
+		hp_globals.span_aggregates = NULL;
+	}
+
+	hp_untrack_stream_close(TSRMLS_C);
+
+	if (hp_globals.http_streams) {
+		zend_hash_destroy(hp_globals.http_streams);
+		FREE_HASHTABLE(hp_globals.http_streams);
+		hp_globals.http_streams = NULL;
+	}
+
+	hp_clean_file_io(TSRMLS_C);
+
+	if (hp_globals.stat_paths) {
+		zend_hash_destroy(hp_globals.stat_paths);
+		FREE_HASHTABLE(hp_globals.stat_paths);
+		hp_globals.stat_paths = NULL;
+	}
+
+	if (hp_globals.resolve_paths) {
+		zend_hash_destroy(hp_globals.resolve_paths);
+		FREE_HASHTABLE(hp_globals.resolve_paths);
+		hp_globals.resolve_paths = NULL;
+	}
+
+	hp_clean_compile_top(TSRMLS_C);
+	hp_clean_autoload_top(TSRMLS_C);
+
+	if (hp_globals.exception_classes) {
+		zend_hash_destroy(hp_globals.exception_classes);
+		FREE_HASHTABLE(hp_globals.exception_classes);
+		hp_globals.exception_classes = NULL;
+	}
+
+	if (hp_globals.tracing_hosts) {
+		zend_hash_destroy(hp_globals.tracing_hosts);
+		FREE_HASHTABLE(hp_globals.tracing_hosts);
+		hp_globals.tracing_hosts = NULL;
+	}
 }
 
 /*
@@ -2102,13 +4751,16 @@ static void hp_clean_profiler_options_state()
 	do {																		\
 		/* Use a hash code to filter most of the string comparisons. */			\
 		uint8 hash_code  = hp_inline_hash(symbol);								\
-		profile_curr = !hp_filter_entry(hash_code, symbol);						\
+		profile_curr = !hp_filter_entry(hash_code, symbol TSRMLS_CC);						\
 		if (profile_curr) {														\
-			hp_entry_t *cur_entry = hp_fast_alloc_hprof_entry();				\
+			hp_entry_t *cur_entry = hp_fast_alloc_hprof_entry(TSRMLS_C);				\
 			(cur_entry)->hash_code = hash_code;									\
 			(cur_entry)->name_hprof = symbol;									\
 			(cur_entry)->prev_hprof = (*(entries));								\
 			(cur_entry)->span_id = -1;											\
+			(cur_entry)->span_end = NULL;										\
+			(cur_entry)->gc_runs = 0;											\
+			(cur_entry)->gc_collected = 0;										\
 			hp_mode_hier_beginfn_cb((entries), (cur_entry), execute_data TSRMLS_CC);			\
 			/* Update entries linked list */									\
 			(*(entries)) = (cur_entry);											\
@@ -2131,7 +4783,7 @@ static void hp_clean_profiler_options_state()
 			cur_entry = (*(entries));										\
 			/* Free top entry and update entries linked list */				\
 			(*(entries)) = (*(entries))->prev_hprof;						\
-			hp_fast_free_hprof_entry(cur_entry);							\
+			hp_fast_free_hprof_entry(cur_entry TSRMLS_CC);							\
 		}																	\
 	} while (0)
 
@@ -2183,7 +4835,7 @@ size_t hp_get_entry_name(hp_entry_t  *entry, char *result_buf, size_t result_len
  *
  * @author mpal
  */
-static inline int hp_filter_entry(uint8 hash_code, char *curr_func)
+static inline int hp_filter_entry(uint8 hash_code, char *curr_func TSRMLS_DC)
 {
 	int exists;
 
@@ -2241,73 +4893,256 @@ size_t hp_get_function_stack(hp_entry_t *entry, int level, char *result_buf, siz
 		len += HP_STACK_DELIM_LEN;
 	}
 
-# undef     HP_STACK_DELIM_LEN
-# undef     HP_STACK_DELIM
+# undef     HP_STACK_DELIM_LEN
+# undef     HP_STACK_DELIM
+
+	return len + hp_get_entry_name(entry, result_buf + len, result_len - len);
+}
+
+/**
+ * Takes an input of the form /a/b/c/d/foo.php and returns
+ * a pointer to one-level directory and basefile name
+ * (d/foo.php) in the same string.
+ */
+static char *hp_get_base_filename(char *filename)
+{
+	char *ptr;
+	int   found = 0;
+
+	if (!filename)
+		return "";
+
+	/* reverse search for "/" and return a ptr to the next char */
+	for (ptr = filename + strlen(filename) - 1; ptr >= filename; ptr--) {
+		if (*ptr == '/') {
+			found++;
+		}
+		if (found == 2) {
+			return ptr + 1;
+		}
+	}
+
+	/* no "/" char found, so return the whole string */
+	return filename;
+}
+
+/**
+ * Normalize an URL to scheme://host:port/path in a single pass, dropping
+ * user info, query string and fragment. With collapse_numeric, path segments
+ * that only consist of digits are replaced by "{id}". Returns the length
+ * written to buf, which is empty for URLs without a scheme.
+ */
+static int hp_normalize_url(const char *url, int url_len, char *buf, int buf_len, int collapse_numeric)
+{
+	const char *p, *q, *host, *end = url + url_len;
+	int len = 0;
+
+#define HP_URL_APPEND(str, n)								\
+	do {													\
+		int _n = (n);										\
+		if (_n > buf_len - 1 - len) {						\
+			_n = buf_len - 1 - len;							\
+		}													\
+		memcpy(buf + len, (str), _n);						\
+		len += _n;											\
+	} while (0)
+
+	for (p = url; p < end && (isalnum((unsigned char)*p) || *p == '+' || *p == '-' || *p == '.'); p++);
+
+	if (p == url || end - p < 3 || p[0] != ':' || p[1] != '/' || p[2] != '/') {
+		buf[0] = '\0';
+		return 0;
+	}
+
+	p += 3;
+	HP_URL_APPEND(url, p - url);
+
+	for (host = p; p < end && *p != '/' && *p != '?' && *p != '#'; p++) {
+		if (*p == '@') {
+			host = p + 1;
+		}
+	}
+
+	HP_URL_APPEND(host, p - host);
+
+	while (p < end && *p != '?' && *p != '#') {
+		for (q = p + 1; q < end && *q != '/' && *q != '?' && *q != '#'; q++);
+
+		if (collapse_numeric && q > p + 1 && strspn(p + 1, "0123456789") >= (size_t)(q - p - 1)) {
+			HP_URL_APPEND("/{id}", 5);
+		} else {
+			HP_URL_APPEND(p, q - p);
+		}
+
+		p = q;
+	}
+
+#undef HP_URL_APPEND
+
+	buf[len] = '\0';
+
+	return len;
+}
+
+static void hp_free_string_ptr(void *ptr)
+{
+	efree(*((char **)ptr));
+}
+
+/**
+ * Summary of an URL for http spans, cached per request by the raw URL. The
+ * returned string is owned by the cache and only valid until the next call.
+ */
+static const char *hp_get_file_summary(char *filename, int filename_len TSRMLS_DC)
+{
+	char buf[TIDEWAYS_MAX_ARGUMENT_LEN];
+	char **cached, *summary;
+	int len;
+
+	if (hp_globals.url_cache == NULL) {
+		ALLOC_HASHTABLE(hp_globals.url_cache);
+		zend_hash_init(hp_globals.url_cache, 32, NULL, hp_free_string_ptr, 0);
+	} else if (zend_hash_find(hp_globals.url_cache, filename, filename_len+1, (void **)&cached) == SUCCESS) {
+		return *cached;
+	}
+
+	len = hp_normalize_url(filename, filename_len, buf, sizeof(buf), hp_globals.url_collapse_numeric);
+	summary = estrndup(buf, len);
+
+	if (zend_hash_num_elements(hp_globals.url_cache) >= TIDEWAYS_MAX_URL_CACHE) {
+		zend_hash_clean(hp_globals.url_cache);
+	}
+
+	zend_hash_update(hp_globals.url_cache, filename, filename_len+1, &summary, sizeof(char*), NULL);
+
+	return summary;
+}
+
+/**
+ * Parse "<trace id>[-<parent span>]" from the X-Tideways-Trace request
+ * header. The CLI SAPI has no request headers, there the environment is used.
+ */
+static void hp_read_incoming_trace(TSRMLS_D)
+{
+	char *value, *p;
+	size_t len;
+	int owned = 1;
+
+	hp_globals.incoming_trace_id[0] = '\0';
+	hp_globals.incoming_parent_span = 0;
+
+	value = sapi_getenv("HTTP_X_TIDEWAYS_TRACE", sizeof("HTTP_X_TIDEWAYS_TRACE")-1 TSRMLS_CC);
+
+	if (value == NULL) {
+		value = getenv("HTTP_X_TIDEWAYS_TRACE");
+		owned = 0;
+	}
+
+	if (value == NULL) {
+		return;
+	}
+
+	len = strspn(value, "0123456789abcdefABCDEF");
+
+	if (len > 0 && len <= TIDEWAYS_TRACE_ID_LEN && (value[len] == '\0' || value[len] == '-')) {
+		memcpy(hp_globals.incoming_trace_id, value, len);
+		hp_globals.incoming_trace_id[len] = '\0';
+
+		for (p = hp_globals.incoming_trace_id; *p; p++) {
+			*p = tolower(*p);
+		}
+
+		if (value[len] == '-') {
+			hp_globals.incoming_parent_span = strtol(value + len + 1, NULL, 10);
+		}
+	}
+
+	if (owned) {
+		efree(value);
+	}
+}
+
+static void hp_init_trace_id(TSRMLS_D)
+{
+	uint64 id;
 
-	return len + hp_get_entry_name(entry, result_buf + len, result_len - len);
+	if (hp_globals.incoming_trace_id[0] != '\0') {
+		memcpy(hp_globals.trace_id, hp_globals.incoming_trace_id, sizeof(hp_globals.trace_id));
+		return;
+	}
+
+	id = ((uint64)(php_combined_lcg(TSRMLS_C) * 0xFFFFFFFFU) << 32) | (uint32)(php_combined_lcg(TSRMLS_C) * 0xFFFFFFFFU);
+	snprintf(hp_globals.trace_id, sizeof(hp_globals.trace_id), "%016llx", (unsigned long long)id);
 }
 
 /**
- * Takes an input of the form /a/b/c/d/foo.php and returns
- * a pointer to one-level directory and basefile name
- * (d/foo.php) in the same string.
+ * Build the set of hosts trace headers are sent to from a comma or space
+ * separated list, so matching a request is a single hash lookup.
  */
-static char *hp_get_base_filename(char *filename)
+static HashTable *hp_compile_tracing_hosts(const char *hosts)
 {
-	char *ptr;
-	int   found = 0;
+	HashTable *set;
+	const char *p = hosts, *end;
+	char *host;
+	int len;
 
-	if (!filename)
-		return "";
+	if (hosts == NULL || *hosts == '\0') {
+		return NULL;
+	}
 
-	/* reverse search for "/" and return a ptr to the next char */
-	for (ptr = filename + strlen(filename) - 1; ptr >= filename; ptr--) {
-		if (*ptr == '/') {
-			found++;
-		}
-		if (found == 2) {
-			return ptr + 1;
+	ALLOC_HASHTABLE(set);
+	zend_hash_init(set, 8, NULL, NULL, 0);
+
+	while (*p) {
+		p += strspn(p, ", \t");
+		end = p + strcspn(p, ", \t");
+		len = end - p;
+
+		if (len > 0) {
+			host = zend_str_tolower_dup(p, len);
+			zend_hash_update(set, host, len+1, &set, sizeof(void*), NULL);
+			efree(host);
 		}
+
+		p = end;
 	}
 
-	/* no "/" char found, so return the whole string */
-	return filename;
+	if (zend_hash_num_elements(set) == 0) {
+		zend_hash_destroy(set);
+		FREE_HASHTABLE(set);
+		return NULL;
+	}
+
+	return set;
 }
 
-static char *hp_get_file_summary(char *filename, int filename_len TSRMLS_DC)
+static int hp_tracing_host_allowed(const char *url TSRMLS_DC)
 {
-	php_url *url;
-	char *ret;
-	int len;
-
-	len = TIDEWAYS_MAX_ARGUMENT_LEN;
-	ret = emalloc(len);
-	snprintf(ret, len, "");
+	char host[TIDEWAYS_MAX_ARGUMENT_LEN];
+	const char *p;
+	int len = 0;
 
-	url = php_url_parse_ex(filename, filename_len);
-
-	if (url->scheme) {
-		snprintf(ret, len, "%s%s://", ret, url->scheme);
-	} else {
-		php_url_free(url);
-		return ret;
+	if (hp_globals.tracing_hosts == NULL || (p = strstr(url, "://")) == NULL) {
+		return 0;
 	}
 
-	if (url->host) {
-		snprintf(ret, len, "%s%s", ret, url->host);
-	}
+	p += 3;
+	len = strcspn(p, "@/?#");
 
-	if (url->port) {
-		snprintf(ret, len, "%s:%d", ret, url->port);
+	if (p[len] == '@') {
+		p += len + 1;
 	}
 
-	if (url->path) {
-		snprintf(ret, len, "%s%s", ret, url->path);
+	len = 0;
+
+	while (p[len] && p[len] != ':' && p[len] != '/' && p[len] != '?' && p[len] != '#' && len < (int)sizeof(host) - 1) {
+		host[len] = tolower(p[len]);
+		len++;
 	}
 
-	php_url_free(url);
+	host[len] = '\0';
 
-	return ret;
+	return len > 0 && zend_hash_exists(hp_globals.tracing_hosts, host, len+1);
 }
 
 static inline void **hp_get_execute_arguments(zend_execute_data *data)
@@ -2415,7 +5250,7 @@ static void hp_detect_transaction_name(char *ret, zend_execute_data *data TSRMLS
 		}
 	}
 
-	hp_transaction_function_clear();
+	hp_transaction_function_clear(TSRMLS_C);
 }
 
 /**
@@ -2443,7 +5278,17 @@ static char *hp_get_function_name(zend_execute_data *data TSRMLS_DC)
 		// This branch includes execution of eval and include/require(_once) calls
 		// We assume it is not 1999 anymore and not much PHP code runs in the
 		// body of a file and if it is, we are ok with adding it to the caller's wt.
-		return NULL;
+		// Unless TIDEWAYS_FLAGS_RUN_INIT asks for file bodies as their own frames.
+		if ((hp_globals.tideways_flags & TIDEWAYS_FLAGS_RUN_INIT) &&
+			curr_func->type == ZEND_USER_FUNCTION && data->opline != NULL &&
+			data->opline->opcode == ZEND_INCLUDE_OR_EVAL && data->opline->extended_value != ZEND_EVAL) {
+			func = hp_get_base_filename((char *)curr_func->op_array.filename);
+			len = sizeof("run_init::") + strlen(func);
+			ret = emalloc(len);
+			snprintf(ret, len, "run_init::%s", func);
+		}
+
+		return ret;
 	}
 
 	/* previously, the order of the tests in the "if" below was
@@ -2472,7 +5317,7 @@ static char *hp_get_function_name(zend_execute_data *data TSRMLS_DC)
 /**
  * Free any items in the free list.
  */
-static void hp_free_the_free_list()
+static void hp_free_the_free_list(TSRMLS_D)
 {
 	hp_entry_t *p = hp_globals.entry_free_list;
 	hp_entry_t *cur;
@@ -2492,7 +5337,7 @@ static void hp_free_the_free_list()
  *
  * @author kannan
  */
-static hp_entry_t *hp_fast_alloc_hprof_entry()
+static hp_entry_t *hp_fast_alloc_hprof_entry(TSRMLS_D)
 {
 	hp_entry_t *p;
 
@@ -2513,7 +5358,7 @@ static hp_entry_t *hp_fast_alloc_hprof_entry()
  *
  * @author kannan
  */
-static void hp_fast_free_hprof_entry(hp_entry_t *p)
+static void hp_fast_free_hprof_entry(hp_entry_t *p TSRMLS_DC)
 {
 	/* we use/overload the prev_hprof field in the structure to link entries in
 	 * the free list. */
@@ -2663,7 +5508,7 @@ static long get_us_interval(struct timeval *start, struct timeval *end)
  */
 static inline double get_us_from_tsc(uint64 count)
 {
-	return count / hp_globals.timebase_factor;
+	return count / tw_timebase_factor;
 }
 
 /**
@@ -2681,6 +5526,230 @@ static double get_timebase_factor()
 #endif
 }
 
+/**
+ * Find the watch registered for a function name, either a trace callback or
+ * a span watch definition from tideways.span_watch_file.
+ */
+static int hp_lookup_watch(char *name, int len, tw_resolved_watch *watch TSRMLS_DC)
+{
+	tw_watch_spec **spec;
+
+	watch->cb = NULL;
+	watch->end = NULL;
+	watch->spec = NULL;
+
+	if (hp_find_trace_callback(name, len, watch TSRMLS_CC) == SUCCESS) {
+		return SUCCESS;
+	}
+
+	if (tw_file_watch_specs != NULL &&
+			zend_hash_find(tw_file_watch_specs, name, len, (void **)&spec) == SUCCESS) {
+		watch->spec = *spec;
+		return SUCCESS;
+	}
+
+	return FAILURE;
+}
+
+static int hp_lookup_method_watch(zend_class_entry *ce, const char *method, tw_resolved_watch *watch TSRMLS_DC)
+{
+	char *name = hp_concat_char(ce->name, ce->name_length, method, strlen(method), "::", 2);
+
+	if (hp_lookup_watch(name, strlen(name)+1, watch TSRMLS_CC) == SUCCESS) {
+		watch->name = name;
+		return SUCCESS;
+	}
+
+	efree(name);
+
+	return FAILURE;
+}
+
+/**
+ * Case-insensitive glob match, '*' matches any sequence and '?' a single
+ * character. The pattern is expected to be lowercased already.
+ */
+static int tw_glob_match(const char *pattern, const char *str)
+{
+	const char *star = NULL, *resume = NULL;
+
+	while (*str) {
+		if (*pattern == '*') {
+			star = pattern++;
+			resume = str;
+		} else if (*pattern == '?' || *pattern == tolower((unsigned char)*str)) {
+			pattern++;
+			str++;
+		} else if (star) {
+			pattern = star + 1;
+			str = ++resume;
+		} else {
+			return 0;
+		}
+	}
+
+	while (*pattern == '*') {
+		pattern++;
+	}
+
+	return *pattern == '\0';
+}
+
+static int hp_lookup_pattern_watch(char *symbol, tw_resolved_watch *watch TSRMLS_DC)
+{
+	zend_llist_position pos;
+	tw_watch_pattern *pattern;
+
+	for (pattern = zend_llist_get_first_ex(&hp_globals.watch_patterns, &pos);
+			pattern != NULL;
+			pattern = zend_llist_get_next_ex(&hp_globals.watch_patterns, &pos)) {
+		if (tw_glob_match(pattern->pattern, symbol)) {
+			watch->cb = pattern->cb;
+			watch->end = NULL;
+			watch->spec = pattern->spec;
+			return SUCCESS;
+		}
+	}
+
+	return FAILURE;
+}
+
+/**
+ * Resolve a user function against the registered watches, first by its own
+ * name, then for methods by the names of the same method in parent classes
+ * and interfaces, and last by the glob patterns. The result is stored in the
+ * cache, so this only happens on the first call of every function.
+ */
+static tw_resolved_watch *hp_resolve_function_watch(zend_function *func, char *symbol TSRMLS_DC)
+{
+	tw_resolved_watch watch, *resolved = &watch;
+	zend_class_entry *ce;
+	const char *method = func->common.function_name;
+	zend_uint i;
+
+	resolved->name = NULL;
+
+	if (hp_lookup_watch(symbol, strlen(symbol)+1, resolved TSRMLS_CC) == FAILURE && func->common.scope != NULL) {
+		for (ce = func->common.scope->parent; ce != NULL; ce = ce->parent) {
+			if (hp_lookup_method_watch(ce, method, resolved TSRMLS_CC) == SUCCESS) {
+				break;
+			}
+		}
+
+		ce = func->common.scope;
+
+		for (i = 0; resolved->name == NULL && i < ce->num_interfaces; i++) {
+			if (ce->interfaces[i] != NULL) {
+				hp_lookup_method_watch(ce->interfaces[i], method, resolved TSRMLS_CC);
+			}
+		}
+	}
+
+	/* patterns only apply to functions and public methods */
+	if (resolved->cb == NULL && resolved->spec == NULL && hp_globals.watch_patterns.count > 0 &&
+			(func->common.scope == NULL || (func->common.fn_flags & ZEND_ACC_PUBLIC))) {
+		hp_lookup_pattern_watch(symbol, resolved TSRMLS_CC);
+	}
+
+	if (hp_globals.resolved_watches == NULL) {
+		ALLOC_HASHTABLE(hp_globals.resolved_watches);
+		zend_hash_init(hp_globals.resolved_watches, 64, NULL, hp_resolved_watch_dtor, 0);
+	}
+
+	zend_hash_index_update(hp_globals.resolved_watches, (ulong)(zend_uintptr_t)&func->op_array,
+		&watch, sizeof(tw_resolved_watch), (void **)&resolved);
+
+	return resolved;
+}
+
+static void hp_resolved_watch_dtor(void *data)
+{
+	tw_resolved_watch *resolved = (tw_resolved_watch *)data;
+
+	if (resolved->name) {
+		efree(resolved->name);
+	}
+}
+
+static void hp_clean_resolved_watches(TSRMLS_D)
+{
+	if (hp_globals.resolved_watches) {
+		zend_hash_destroy(hp_globals.resolved_watches);
+		FREE_HASHTABLE(hp_globals.resolved_watches);
+		hp_globals.resolved_watches = NULL;
+	}
+}
+
+/**
+ * Start the span of a watched function and remember its end callback in the
+ * entry.
+ */
+static void hp_trace_watched_function(hp_entry_t *current, zend_execute_data *data TSRMLS_DC)
+{
+	char *symbol = current->name_hprof;
+	zend_function *func = data->function_state.function;
+	tw_resolved_watch lookup, *watch = &lookup;
+	void **args;
+	int arg_count;
+
+	/* run_init:: frames of file bodies can not be watched, their op_array is
+	 * freed as soon as the include returns and must not end up in the cache */
+	if (func->common.function_name == NULL) {
+		return;
+	}
+
+	if (hp_globals.resolved_stale) {
+		hp_clean_resolved_watches(TSRMLS_C);
+		hp_globals.resolved_stale = 0;
+	}
+
+	if (func->type == ZEND_USER_FUNCTION && (func->common.fn_flags & ZEND_ACC_CLOSURE) == 0) {
+		if (hp_globals.resolved_watches == NULL ||
+				zend_hash_index_find(hp_globals.resolved_watches, (ulong)(zend_uintptr_t)&func->op_array, (void **)&watch) == FAILURE) {
+			watch = hp_resolve_function_watch(func, symbol TSRMLS_CC);
+		}
+
+		if (watch->name != NULL) {
+			symbol = watch->name;
+		}
+	} else if (hp_lookup_watch(symbol, strlen(symbol)+1, watch TSRMLS_CC) == FAILURE) {
+		return;
+	}
+
+	if (watch->cb == NULL && watch->spec == NULL) {
+		return;
+	}
+
+	args = hp_get_execute_arguments(data);
+	arg_count = (int)(zend_uintptr_t) *args;
+
+	if (watch->cb != NULL) {
+		current->span_id = watch->cb(symbol, args, arg_count, data->object TSRMLS_CC);
+		current->span_end = watch->end;
+	} else {
+		current->span_id = tw_watch_spec_record(watch->spec, symbol, args, arg_count, data->object TSRMLS_CC);
+	}
+}
+
+/**
+ * A garbage collection run happened since the last function begin or end,
+ * so it was triggered by code of the frame on top. PHP 5 has no hook around
+ * the collector for runs started by the engine, so only runs and collected
+ * items are counted, not the pause.
+ */
+static inline void hp_detect_gc_run(hp_entry_t *entry TSRMLS_DC)
+{
+	if (GC_G(gc_runs) == hp_globals.gc_seen_runs || entry == NULL) {
+		return;
+	}
+
+	entry->gc_runs += GC_G(gc_runs) - hp_globals.gc_seen_runs;
+	entry->gc_collected += GC_G(collected) - hp_globals.gc_seen_collected;
+
+	hp_globals.gc_seen_runs = GC_G(gc_runs);
+	hp_globals.gc_seen_collected = GC_G(collected);
+}
+
 /**
  * TIDEWAYS_MODE_HIERARCHICAL's begin function callback
  *
@@ -2689,7 +5758,6 @@ static double get_timebase_factor()
 void hp_mode_hier_beginfn_cb(hp_entry_t **entries, hp_entry_t *current, zend_execute_data *data TSRMLS_DC)
 {
 	hp_entry_t   *p;
-	tw_trace_callback *callback;
 	int    recurse_level = 0;
 
 	if ((hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_HIERACHICAL) == 0) {
@@ -2711,14 +5779,10 @@ void hp_mode_hier_beginfn_cb(hp_entry_t **entries, hp_entry_t *current, zend_exe
 	/* Get start tsc counter */
 	current->tsc_start = cycle_timer();
 
-	if ((hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_SPANS) == 0) {
-		if (data != NULL && zend_hash_find(hp_globals.trace_callbacks, current->name_hprof, strlen(current->name_hprof)+1, (void **)&callback) == SUCCESS) {
-			void **args =  hp_get_execute_arguments(data);
-			int arg_count = (int)(zend_uintptr_t) *args;
-			zval *obj = data->object;
+	hp_detect_gc_run(*entries TSRMLS_CC);
 
-			current->span_id = (*callback)(current->name_hprof, args, arg_count, obj TSRMLS_CC);
-		}
+	if ((hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_SPANS) == 0 && data != NULL) {
+		hp_trace_watched_function(current, data TSRMLS_CC);
 	}
 
 	/* Get CPU usage */
@@ -2759,6 +5823,8 @@ void hp_mode_hier_endfn_cb(hp_entry_t **entries, zend_execute_data *data TSRMLS_
 	tsc_end = cycle_timer();
 	wt = get_us_from_tsc(tsc_end - top->tsc_start);
 
+	hp_detect_gc_run(top TSRMLS_CC);
+
 	if (hp_globals.tideways_flags & TIDEWAYS_FLAGS_CPU) {
 		cpu = get_us_from_tsc(cpu_timer() - top->cpu_start);
 	}
@@ -2766,7 +5832,18 @@ void hp_mode_hier_endfn_cb(hp_entry_t **entries, zend_execute_data *data TSRMLS_
 	if ((hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_SPANS) == 0 && top->span_id >= 0) {
 		double start = get_us_from_tsc(top->tsc_start - hp_globals.start_time);
 		double end = get_us_from_tsc(tsc_end - hp_globals.start_time);
-		tw_span_record_duration(top->span_id, start, end);
+		tw_span_aggregate *aggregate = tw_span_aggregate_find(top->span_id TSRMLS_CC);
+
+		if (aggregate != NULL) {
+			tw_span_aggregate_duration(aggregate, start, end);
+		} else {
+			tw_span_record_duration(top->span_id, start, end TSRMLS_CC);
+		}
+	}
+
+	if ((hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_SPANS) == 0 && top->span_end != NULL && data != NULL) {
+		void **args = hp_get_execute_arguments(data);
+		top->span_end(top->span_id, args, (int)(zend_uintptr_t) *args, data->object TSRMLS_CC);
 	}
 
 	if ((hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_HIERACHICAL) > 0) {
@@ -2785,6 +5862,11 @@ void hp_mode_hier_endfn_cb(hp_entry_t **entries, zend_execute_data *data TSRMLS_
 	hp_inc_count(counts, "ct", 1  TSRMLS_CC);
 	hp_inc_count(counts, "wt", wt TSRMLS_CC);
 
+	if (top->gc_runs > 0) {
+		hp_inc_count(counts, "gc", top->gc_runs TSRMLS_CC);
+		hp_inc_count(counts, "gcc", top->gc_collected TSRMLS_CC);
+	}
+
 	if (hp_globals.tideways_flags & TIDEWAYS_FLAGS_CPU) {
 		/* Bump CPU stats in the counts hashtable */
 		hp_inc_count(counts, "cpu", cpu TSRMLS_CC);
@@ -2862,6 +5944,25 @@ ZEND_DLEXPORT void hp_execute_ex (zend_execute_data *execute_data TSRMLS_DC) {
 	char          *func = NULL;
 	int hp_profile_flag = 1;
 
+#ifdef ZTS
+	if (!hp_globals.enabled || (hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_USERLAND)) {
+		if (hp_globals.enabled && hp_globals.transaction_function) {
+#if PHP_VERSION_ID < 50500
+			hp_detect_tx_execute(ops TSRMLS_CC);
+#else
+			hp_detect_tx_execute_ex(execute_data TSRMLS_CC);
+#endif
+		} else {
+#if PHP_VERSION_ID < 50500
+			_zend_execute(ops TSRMLS_CC);
+#else
+			_zend_execute_ex(execute_data TSRMLS_CC);
+#endif
+		}
+		return;
+	}
+#endif
+
 	func = hp_get_function_name(real_execute_data TSRMLS_CC);
 	if (!func) {
 #if PHP_VERSION_ID < 50500
@@ -2914,6 +6015,9 @@ ZEND_DLEXPORT void hp_execute_internal(zend_execute_data *execute_data,
 	char             *func = NULL;
 	int    hp_profile_flag = 1;
 
+#ifdef ZTS
+	if (hp_globals.enabled && !(hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_BUILTINS))
+#endif
 	func = hp_get_function_name(execute_data TSRMLS_CC);
 
 	if (func) {
@@ -2937,27 +6041,122 @@ ZEND_DLEXPORT void hp_execute_internal(zend_execute_data *execute_data,
 
 	if (func) {
 		if (hp_globals.entries) {
+#if PHP_VERSION_ID >= 50500
+			hp_globals.internal_return = fci != NULL ? *fci->retval_ptr_ptr : EX_T(execute_data->opline->result.var).var.ptr;
+#elif PHP_VERSION_ID >= 50400
+			hp_globals.internal_return = EX_T(execute_data->opline->result.var).var.ptr;
+#else
+			hp_globals.internal_return = EX_T(execute_data->opline->result.u.var).var.ptr;
+#endif
 			END_PROFILING(&hp_globals.entries, hp_profile_flag, execute_data);
+			hp_globals.internal_return = NULL;
 		}
 		efree(func);
 	}
 }
 
+typedef struct tw_compile_entry {
+	char *filename;
+	uint64 start;
+	uint64 end;
+} tw_compile_entry;
+
+/* Keep the TIDEWAYS_TOP_COMPILES slowest compiles, sorted by duration */
+static void hp_record_compile(const char *filename, uint64 start, uint64 end TSRMLS_DC)
+{
+	tw_compile_entry *top;
+	int i;
+
+	if (hp_globals.compile_top == NULL) {
+		hp_globals.compile_top = ecalloc(TIDEWAYS_TOP_COMPILES, sizeof(tw_compile_entry));
+	}
+
+	top = hp_globals.compile_top;
+	i = hp_globals.compile_top_len;
+
+	if (i == TIDEWAYS_TOP_COMPILES) {
+		if (top[i-1].end - top[i-1].start >= end - start) {
+			return;
+		}
+
+		efree(top[--i].filename);
+	} else {
+		hp_globals.compile_top_len++;
+	}
+
+	for (; i > 0 && top[i-1].end - top[i-1].start < end - start; i--) {
+		top[i] = top[i-1];
+	}
+
+	top[i].filename = estrdup(filename);
+	top[i].start = start;
+	top[i].end = end;
+}
+
+/* One "compile" span per recorded file compile, in order of duration */
+static void hp_compile_spans(TSRMLS_D)
+{
+	long idx;
+	int i;
+
+	for (i = 0; i < hp_globals.compile_top_len; i++) {
+		idx = tw_span_create("compile", 7 TSRMLS_CC);
+		tw_span_record_duration(idx,
+			get_us_from_tsc(hp_globals.compile_top[i].start - hp_globals.start_time),
+			get_us_from_tsc(hp_globals.compile_top[i].end - hp_globals.start_time) TSRMLS_CC);
+		tw_span_annotate_string(idx, "title", hp_get_base_filename(hp_globals.compile_top[i].filename), 1 TSRMLS_CC);
+	}
+}
+
+static void hp_clean_compile_top(TSRMLS_D)
+{
+	int i;
+
+	for (i = 0; i < hp_globals.compile_top_len; i++) {
+		efree(hp_globals.compile_top[i].filename);
+	}
+
+	if (hp_globals.compile_top) {
+		efree(hp_globals.compile_top);
+		hp_globals.compile_top = NULL;
+	}
+
+	hp_globals.compile_top_len = 0;
+}
+
 /**
  * Proxy for zend_compile_file(). Used to profile PHP compilation time.
  *
+ * The scanner registers every file it really compiles in CG(open_files),
+ * a call that returns an op_array without growing that list was served
+ * by the opcode cache. This is a best-effort guess, the cache is not asked.
+ *
  * @author kannan, hzhao
  */
 ZEND_DLEXPORT zend_op_array* hp_compile_file(zend_file_handle *file_handle, int type TSRMLS_DC)
 {
 	zend_op_array  *ret;
-	uint64 start = cycle_timer();
+	uint64 start = cycle_timer(), end;
+	size_t open_files = zend_llist_count(&CG(open_files));
+
+#ifdef ZTS
+	if (!hp_globals.enabled || (hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_COMPILE)) {
+		return _zend_compile_file(file_handle, type TSRMLS_CC);
+	}
+#endif
 
 	hp_globals.compile_count++;
 
 	ret = _zend_compile_file(file_handle, type TSRMLS_CC);
 
-	hp_globals.compile_wt += get_us_from_tsc(cycle_timer() - start);
+	end = cycle_timer();
+	hp_globals.compile_wt += get_us_from_tsc(end - start);
+
+	if (ret != NULL && zend_llist_count(&CG(open_files)) == open_files) {
+		hp_globals.compile_hits++;
+	} else if (ret != NULL && (hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_SPANS) == 0) {
+		hp_record_compile(ret->filename ? ret->filename : file_handle->filename, start, end TSRMLS_CC);
+	}
 
 	return ret;
 }
@@ -2969,22 +6168,114 @@ ZEND_DLEXPORT zend_op_array* hp_compile_string(zval *source_string, char *filena
 {
 	zend_op_array  *ret;
 	uint64 start = cycle_timer();
+	double wt;
+
+#ifdef ZTS
+	if (!hp_globals.enabled || (hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_COMPILE)) {
+		return _zend_compile_string(source_string, filename TSRMLS_CC);
+	}
+#endif
 
 	hp_globals.compile_count++;
+	hp_globals.eval_count++;
+
+	ret = _zend_compile_string(source_string, filename TSRMLS_CC);
+
+	wt = get_us_from_tsc(cycle_timer() - start);
+	hp_globals.compile_wt += wt;
+	hp_globals.eval_wt += wt;
+
+	return ret;
+}
+
+/**
+ * **************************
+ * MAIN TIDEWAYS CALLBACKS
+ * **************************
+ */
+
+/**
+ * Install the engine hook proxies. Without ZTS, hp_begin() installs the ones
+ * the flags ask for and hp_stop() removes them again, so requests that are
+ * not profiled do not pass through them. The hooks are process wide, with
+ * ZTS they are all installed once in MINIT and every proxy checks if
+ * profiling is enabled in its own thread.
+ */
+static void hp_install_hooks(uint32 flags TSRMLS_DC)
+{
+	/* Replace zend_compile file/string with our proxies */
+	_zend_compile_file = zend_compile_file;
+	_zend_compile_string = zend_compile_string;
+
+	if (!(flags & TIDEWAYS_FLAGS_NO_COMPILE)) {
+		zend_compile_file  = hp_compile_file;
+		zend_compile_string = hp_compile_string;
+	}
+
+	_zend_resolve_path = zend_resolve_path;
+
+	if (!(flags & TIDEWAYS_FLAGS_NO_SPANS)) {
+		zend_resolve_path = hp_resolve_path;
+	}
+
+	/* Replace zend_execute with our proxy */
+#if PHP_VERSION_ID < 50500
+	_zend_execute = zend_execute;
+#else
+	_zend_execute_ex = zend_execute_ex;
+#endif
+
+	if (!(flags & TIDEWAYS_FLAGS_NO_USERLAND)) {
+#if PHP_VERSION_ID < 50500
+		zend_execute  = hp_execute;
+#else
+		zend_execute_ex  = hp_execute_ex;
+#endif
+	} else if (hp_globals.transaction_function) {
+#if PHP_VERSION_ID < 50500
+		zend_execute  = hp_detect_tx_execute;
+#else
+		zend_execute_ex  = hp_detect_tx_execute_ex;
+#endif
+	}
+
+	tideways_original_error_cb = zend_error_cb;
+	zend_error_cb = tideways_error_cb;
+
+	tideways_original_throw_exception_hook = zend_throw_exception_hook;
+	zend_throw_exception_hook = tideways_throw_exception_hook;
+
+	/* Replace zend_execute_internal with our proxy */
+	_zend_execute_internal = zend_execute_internal;
+	if (!(flags & TIDEWAYS_FLAGS_NO_BUILTINS)) {
+		/* if NO_BUILTINS is not set (i.e. user wants to profile builtins),
+		 * then we intercept internal (builtin) function calls.
+		 */
+		zend_execute_internal = hp_execute_internal;
+	}
+
+	hp_init_plain_files_wrapper(flags TSRMLS_CC);
+}
+
+static void hp_remove_hooks(TSRMLS_D)
+{
+#if PHP_VERSION_ID < 50500
+	zend_execute = _zend_execute;
+#else
+	zend_execute_ex = _zend_execute_ex;
+#endif
 
-	ret = _zend_compile_string(source_string, filename TSRMLS_CC);
+	zend_execute_internal = _zend_execute_internal;
+	zend_compile_file     = _zend_compile_file;
+	zend_compile_string   = _zend_compile_string;
+	zend_resolve_path     = _zend_resolve_path;
 
-	hp_globals.compile_wt += get_us_from_tsc(cycle_timer() - start);
+	zend_error_cb = tideways_original_error_cb;
+	zend_throw_exception_hook = tideways_original_throw_exception_hook;
 
-	return ret;
+	hp_free_plain_files_wrapper(TSRMLS_C);
 }
 
-/**
- * **************************
- * MAIN TIDEWAYS CALLBACKS
- * **************************
- */
-
 /**
  * This function gets called once when Tideways gets enabled.
  * It replaces all the functions like zend_execute, zend_execute_internal,
@@ -2998,47 +6289,9 @@ static void hp_begin(long tideways_flags TSRMLS_DC)
 		hp_globals.enabled      = 1;
 		hp_globals.tideways_flags = (uint32)tideways_flags;
 
-		/* Replace zend_compile file/string with our proxies */
-		_zend_compile_file = zend_compile_file;
-		_zend_compile_string = zend_compile_string;
-
-		if (!(hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_COMPILE)) {
-			zend_compile_file  = hp_compile_file;
-			zend_compile_string = hp_compile_string;
-		}
-
-		/* Replace zend_execute with our proxy */
-#if PHP_VERSION_ID < 50500
-		_zend_execute = zend_execute;
-#else
-		_zend_execute_ex = zend_execute_ex;
-#endif
-
-		if (!(hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_USERLAND)) {
-#if PHP_VERSION_ID < 50500
-			zend_execute  = hp_execute;
-#else
-			zend_execute_ex  = hp_execute_ex;
+#ifndef ZTS
+		hp_install_hooks(hp_globals.tideways_flags TSRMLS_CC);
 #endif
-		} else if (hp_globals.transaction_function) {
-#if PHP_VERSION_ID < 50500
-			zend_execute  = hp_detect_tx_execute;
-#else
-			zend_execute_ex  = hp_detect_tx_execute_ex;
-#endif
-		}
-
-		tideways_original_error_cb = zend_error_cb;
-		zend_error_cb = tideways_error_cb;
-
-		/* Replace zend_execute_internal with our proxy */
-		_zend_execute_internal = zend_execute_internal;
-		if (!(hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_BUILTINS)) {
-			/* if NO_BUILTINS is not set (i.e. user wants to profile builtins),
-			 * then we intercept internal (builtin) function calls.
-			 */
-			zend_execute_internal = hp_execute_internal;
-		}
 
 		/* one time initializations */
 		hp_init_profiler_state(TSRMLS_C);
@@ -3046,13 +6299,26 @@ static void hp_begin(long tideways_flags TSRMLS_DC)
 		/* start profiling from fictitious main() */
 		hp_globals.root = estrdup(ROOT_SYMBOL);
 		hp_globals.start_time = cycle_timer();
+		hp_globals.gc_seen_runs = GC_G(gc_runs);
+		hp_globals.gc_seen_collected = GC_G(collected);
+		memset(hp_globals.error_counts, 0, sizeof(hp_globals.error_counts));
+		hp_globals.exception_count = 0;
+		hp_globals.exception_wt = 0;
+		hp_globals.exception_throw_tsc = 0;
 
 		if ((hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_SPANS) == 0) {
 			hp_globals.cpu_start = cpu_timer();
 		}
 
-		tw_span_create("app", 3);
-		tw_span_timer_start(0);
+		tw_span_create("app", 3 TSRMLS_CC);
+		tw_span_timer_start(0 TSRMLS_CC);
+
+		hp_init_trace_id(TSRMLS_C);
+
+		if (hp_globals.incoming_trace_id[0] != '\0') {
+			tw_span_annotate_string(0, "trace", hp_globals.trace_id, 1 TSRMLS_CC);
+			tw_span_annotate_long(0, "parent", hp_globals.incoming_parent_span TSRMLS_CC);
+		}
 
 		BEGIN_PROFILING(&hp_globals.entries, hp_globals.root, hp_profile_flag, NULL);
 	}
@@ -3084,28 +6350,71 @@ static void hp_end(TSRMLS_D)
 static void hp_stop(TSRMLS_D)
 {
 	int hp_profile_flag = 1;
+	int i;
 
 	/* End any unfinished calls */
 	while (hp_globals.entries) {
 		END_PROFILING(&hp_globals.entries, hp_profile_flag, NULL);
 	}
 
-	tw_span_timer_stop(0);
+	tw_span_timer_stop(0 TSRMLS_CC);
 
 	if ((hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_SPANS) == 0) {
+		hp_finish_curl_multi_transfers(TSRMLS_C);
+		hp_finish_http_streams(TSRMLS_C);
+
 		if ((GC_G(gc_runs) - hp_globals.gc_runs) > 0) {
-			tw_span_annotate_long(0, "gc", GC_G(gc_runs) - hp_globals.gc_runs);
-			tw_span_annotate_long(0, "gcc", GC_G(collected) - hp_globals.gc_collected);
+			tw_span_annotate_long(0, "gc", GC_G(gc_runs) - hp_globals.gc_runs TSRMLS_CC);
+			tw_span_annotate_long(0, "gcc", GC_G(collected) - hp_globals.gc_collected TSRMLS_CC);
+		}
+
+		for (i = 0; i < TW_ERROR_KINDS; i++) {
+			if (hp_globals.error_counts[i] > 0) {
+				tw_span_annotate_long(0, (char *)tw_error_kind_keys[i], hp_globals.error_counts[i] TSRMLS_CC);
+			}
+		}
+
+		if (hp_globals.exception_count > 0) {
+			tw_span_annotate_long(0, "xct", hp_globals.exception_count TSRMLS_CC);
+			tw_span_annotate_long(0, "xwt", (long)hp_globals.exception_wt TSRMLS_CC);
+			hp_annotate_top_counts(hp_globals.exception_classes, "exceptions" TSRMLS_CC);
 		}
 
 		if (hp_globals.compile_count > 0) {
-			tw_span_annotate_long(0, "cct", hp_globals.compile_count);
+			tw_span_annotate_long(0, "cct", hp_globals.compile_count TSRMLS_CC);
 		}
 		if (hp_globals.compile_wt > 0) {
-			tw_span_annotate_long(0, "cwt", hp_globals.compile_wt);
+			tw_span_annotate_long(0, "cwt", hp_globals.compile_wt TSRMLS_CC);
+		}
+
+		if (hp_globals.compile_hits > 0) {
+			tw_span_annotate_long(0, "cht", hp_globals.compile_hits TSRMLS_CC);
+		}
+
+		if (hp_globals.eval_count > 0) {
+			tw_span_annotate_long(0, "ect", hp_globals.eval_count TSRMLS_CC);
+			tw_span_annotate_long(0, "ewt", hp_globals.eval_wt TSRMLS_CC);
+		}
+
+		hp_compile_spans(TSRMLS_C);
+		hp_annotate_autoloads(TSRMLS_C);
+
+		if (hp_globals.stat_count > 0) {
+			tw_span_annotate_long(0, "sct", hp_globals.stat_count TSRMLS_CC);
+			tw_span_annotate_long(0, "swt", hp_globals.stat_wt TSRMLS_CC);
 		}
 
-		tw_span_annotate_long(0, "cpu", get_us_from_tsc(cpu_timer() - hp_globals.cpu_start));
+		if (hp_globals.resolve_count > 0) {
+			tw_span_annotate_long(0, "rct", hp_globals.resolve_count TSRMLS_CC);
+			tw_span_annotate_long(0, "rwt", hp_globals.resolve_wt TSRMLS_CC);
+		}
+
+		hp_annotate_top_counts(hp_globals.stat_paths, "stat_top" TSRMLS_CC);
+		hp_annotate_top_counts(hp_globals.resolve_paths, "resolve_top" TSRMLS_CC);
+
+		hp_annotate_file_io(TSRMLS_C);
+
+		tw_span_annotate_long(0, "cpu", get_us_from_tsc(cpu_timer() - hp_globals.cpu_start) TSRMLS_CC);
 	}
 
 	if (hp_globals.root) {
@@ -3114,18 +6423,10 @@ static void hp_stop(TSRMLS_D)
 	}
 
 	/* Remove proxies, restore the originals */
-#if PHP_VERSION_ID < 50500
-	zend_execute = _zend_execute;
-#else
-	zend_execute_ex = _zend_execute_ex;
+#ifndef ZTS
+	hp_remove_hooks(TSRMLS_C);
 #endif
 
-	zend_execute_internal = _zend_execute_internal;
-	zend_compile_file     = _zend_compile_file;
-	zend_compile_string   = _zend_compile_string;
-
-	zend_error_cb = tideways_original_error_cb;
-
 	/* Stop profiling */
 	hp_globals.enabled = 0;
 }
@@ -3240,12 +6541,98 @@ static inline void hp_array_del(char **name_array)
 	}
 }
 
+/* Bump a metric of the edge of the function on top of the stack */
+static void hp_inc_current_edge_count(char *name TSRMLS_DC)
+{
+	char symbol[SCRATCH_BUF_LEN] = "";
+	zval *counts;
+
+	if (hp_globals.entries == NULL || (hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_HIERACHICAL) > 0) {
+		return;
+	}
+
+	hp_get_function_stack(hp_globals.entries, 2, symbol, sizeof(symbol));
+
+	if ((counts = hp_hash_lookup(hp_globals.stats_count, symbol TSRMLS_CC))) {
+		hp_inc_count(counts, name, 1 TSRMLS_CC);
+	}
+}
+
+/**
+ * Count an error for the function on top of the stack. Only bumps counters,
+ * notice storms must not pay for a backtrace each.
+ */
+static void hp_count_error(int type TSRMLS_DC)
+{
+	int kind = hp_error_kind(type);
+
+	hp_globals.error_counts[kind]++;
+	hp_inc_current_edge_count((char *)tw_error_kind_keys[kind] TSRMLS_CC);
+}
+
+/**
+ * Count thrown exceptions per class and for the throwing function ("xct").
+ * The time until the first catch block is reached, which includes unwinding
+ * the frames in between, is measured by tideways_catch_handler().
+ */
+static void tideways_throw_exception_hook(zval *exception TSRMLS_DC)
+{
+	zend_class_entry *ce;
+	long count = 1, *existing;
+
+	if (hp_globals.enabled && exception != NULL && Z_TYPE_P(exception) == IS_OBJECT) {
+		ce = Z_OBJCE_P(exception);
+
+		if (hp_globals.exception_classes == NULL) {
+			ALLOC_HASHTABLE(hp_globals.exception_classes);
+			zend_hash_init(hp_globals.exception_classes, 8, NULL, NULL, 0);
+		}
+
+		if (zend_hash_find(hp_globals.exception_classes, ce->name, ce->name_length+1, (void **)&existing) == SUCCESS) {
+			count = *existing + 1;
+		}
+
+		zend_hash_update(hp_globals.exception_classes, ce->name, ce->name_length+1, &count, sizeof(long), NULL);
+
+		hp_globals.exception_count++;
+		hp_globals.exception_throw_tsc = cycle_timer();
+		hp_inc_current_edge_count("xct" TSRMLS_CC);
+	}
+
+	if (tideways_original_throw_exception_hook) {
+		tideways_original_throw_exception_hook(exception TSRMLS_CC);
+	}
+}
+
+/* Installed in MINIT, scripts compiled before cannot pick up user opcode handlers */
+static int tideways_catch_handler(ZEND_OPCODE_HANDLER_ARGS)
+{
+	if (hp_globals.enabled && hp_globals.exception_throw_tsc > 0) {
+		hp_globals.exception_wt += get_us_from_tsc(cycle_timer() - hp_globals.exception_throw_tsc);
+		hp_globals.exception_throw_tsc = 0;
+	}
+
+	if (tideways_original_catch_handler) {
+		return tideways_original_catch_handler(ZEND_OPCODE_HANDLER_ARGS_PASSTHRU);
+	}
+
+	return ZEND_USER_OPCODE_DISPATCH;
+}
+
 void tideways_error_cb(int type, const char *error_filename, const uint error_lineno, const char *format, va_list args)
 {
 	TSRMLS_FETCH();
 	error_handling_t  error_handling;
 	zval *backtrace;
 
+	if (!hp_globals.enabled) {
+		/* only with ZTS, the hooks stay installed */
+		tideways_original_error_cb(type, error_filename, error_lineno, format, args);
+		return;
+	}
+
+	hp_count_error(type TSRMLS_CC);
+
 #if (PHP_MAJOR_VERSION == 5 && PHP_MINOR_VERSION >= 3) || PHP_MAJOR_VERSION >= 6
 	error_handling  = EG(error_handling);
 #else
@@ -3327,29 +6714,371 @@ static inline void hp_string_clean(hp_string *str)
 	efree(str->value);
 }
 
+static int tw_watch_extractor_from_zval(tw_watch_extractor *extractor, zval *value, int persistent)
+{
+	extractor->type = TW_WATCH_EXTRACT_NONE;
+	extractor->property = NULL;
+
+	switch (Z_TYPE_P(value)) {
+		case IS_LONG:
+			if (Z_LVAL_P(value) < 0) {
+				return FAILURE;
+			}
+
+			extractor->type = TW_WATCH_EXTRACT_ARGUMENT;
+			extractor->argument = Z_LVAL_P(value);
+			return SUCCESS;
+
+		case IS_STRING:
+			extractor->type = TW_WATCH_EXTRACT_PROPERTY;
+			extractor->property = pestrndup(Z_STRVAL_P(value), Z_STRLEN_P(value), persistent);
+			extractor->property_len = Z_STRLEN_P(value);
+			return SUCCESS;
+	}
+
+	return FAILURE;
+}
+
+/**
+ * Parse an extractor from the watch file syntax: "$0" selects the first
+ * argument, "->name" selects the property "name" of the called object.
+ */
+static int tw_watch_extractor_from_string(tw_watch_extractor *extractor, char *value, int persistent)
+{
+	char *end;
+
+	extractor->type = TW_WATCH_EXTRACT_NONE;
+	extractor->property = NULL;
+
+	if (value[0] == '$' && isdigit((unsigned char)value[1])) {
+		extractor->type = TW_WATCH_EXTRACT_ARGUMENT;
+		extractor->argument = strtol(value + 1, &end, 10);
+
+		if (*end != '\0') {
+			extractor->type = TW_WATCH_EXTRACT_NONE;
+			return FAILURE;
+		}
+
+		return SUCCESS;
+	}
+
+	if (value[0] == '-' && value[1] == '>' && value[2] != '\0') {
+		extractor->type = TW_WATCH_EXTRACT_PROPERTY;
+		extractor->property_len = strlen(value + 2);
+		extractor->property = pestrndup(value + 2, extractor->property_len, persistent);
+
+		return SUCCESS;
+	}
+
+	return FAILURE;
+}
+
+static void free_tw_watch_spec(void *spec_ptr)
+{
+	tw_watch_spec *spec = *((tw_watch_spec **)spec_ptr);
+	int i;
+
+	for (i = 0; i < spec->annotations_len; i++) {
+		pefree(spec->annotations[i].key, spec->persistent);
+
+		if (spec->annotations[i].extractor.property) {
+			pefree(spec->annotations[i].extractor.property, spec->persistent);
+		}
+	}
+
+	if (spec->annotations) {
+		pefree(spec->annotations, spec->persistent);
+	}
+
+	if (spec->title.property) {
+		pefree(spec->title.property, spec->persistent);
+	}
+
+	pefree(spec->category, spec->persistent);
+	pefree(spec, spec->persistent);
+}
+
+static tw_watch_spec *tw_watch_spec_alloc(char *category, int category_len, int annotations_len, int persistent)
+{
+	tw_watch_spec *spec;
+
+	spec = pemalloc(sizeof(tw_watch_spec), persistent);
+	spec->persistent = persistent;
+	spec->category = pestrndup(category, category_len, persistent);
+	spec->category_len = category_len;
+	spec->title.type = TW_WATCH_EXTRACT_NONE;
+	spec->title.property = NULL;
+	spec->annotations = annotations_len > 0 ? pecalloc(annotations_len, sizeof(tw_watch_annotation), persistent) : NULL;
+	spec->annotations_len = 0;
+
+	return spec;
+}
+
+/**
+ * Build a native span watch from an array of the form:
+ *
+ *   array('category' => 'http', 'title' => 0, 'annotations' => array('service' => 'name'))
+ *
+ * Integer extractors select an argument by position, strings select a
+ * property of the called object.
+ */
+static tw_watch_spec *tw_watch_spec_create(zval *options TSRMLS_DC)
+{
+	tw_watch_spec *spec;
+	zval *value, **data;
+	HashTable *ht;
+	HashPosition pos;
+	char *key;
+	uint key_len;
+	ulong num_key;
+
+	zval *annotations;
+
+	value = hp_zval_at_key("category", options);
+	annotations = hp_zval_at_key("annotations", options);
+
+	if (annotations != NULL && Z_TYPE_P(annotations) != IS_ARRAY) {
+		annotations = NULL;
+	}
+
+	if (value != NULL && Z_TYPE_P(value) == IS_STRING) {
+		spec = tw_watch_spec_alloc(Z_STRVAL_P(value), Z_STRLEN_P(value), annotations ? zend_hash_num_elements(Z_ARRVAL_P(annotations)) : 0, 0);
+	} else {
+		spec = tw_watch_spec_alloc("php", 3, annotations ? zend_hash_num_elements(Z_ARRVAL_P(annotations)) : 0, 0);
+	}
+
+	value = hp_zval_at_key("title", options);
+
+	if (value != NULL && tw_watch_extractor_from_zval(&spec->title, value, 0) == FAILURE) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Span watch title must be an argument index or property name");
+	}
+
+	if (annotations == NULL) {
+		return spec;
+	}
+
+	ht = Z_ARRVAL_P(annotations);
+
+	for (zend_hash_internal_pointer_reset_ex(ht, &pos);
+			zend_hash_get_current_data_ex(ht, (void **)&data, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(ht, &pos)) {
+
+		if (zend_hash_get_current_key_ex(ht, &key, &key_len, &num_key, 0, &pos) != HASH_KEY_IS_STRING) {
+			continue;
+		}
+
+		if (tw_watch_extractor_from_zval(&spec->annotations[spec->annotations_len].extractor, *data, 0) == FAILURE) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Span watch annotation '%s' must be an argument index or property name", key);
+			continue;
+		}
+
+		spec->annotations[spec->annotations_len].key = estrndup(key, key_len - 1);
+		spec->annotations_len++;
+	}
+
+	return spec;
+}
+
+static void tideways_add_spec_watch(tw_watch_spec *spec, char *func, int func_len TSRMLS_DC)
+{
+	tw_trace_callback cb;
+
+	if (hp_globals.trace_watch_specs == NULL) {
+		ALLOC_HASHTABLE(hp_globals.trace_watch_specs);
+		zend_hash_init(hp_globals.trace_watch_specs, 255, NULL, free_tw_watch_spec, 0);
+	}
+
+	zend_hash_update(hp_globals.trace_watch_specs, func, func_len+1, &spec, sizeof(tw_watch_spec*), NULL);
+	cb = tw_trace_callback_watch_spec;
+	register_trace_callback_len(func, func_len, cb);
+}
+
+static void free_tw_watch_pattern(void *data)
+{
+	tw_watch_pattern *pattern = (tw_watch_pattern *)data;
+
+	efree(pattern->pattern);
+
+	if (pattern->spec) {
+		free_tw_watch_spec(&pattern->spec);
+	}
+}
+
+/**
+ * Register a glob pattern. Patterns are only evaluated on the first call of
+ * each user function, see hp_resolve_function_watch().
+ */
+static void tideways_add_pattern_watch(char *func, int func_len, tw_trace_callback cb, tw_watch_spec *spec TSRMLS_DC)
+{
+	tw_watch_pattern pattern;
+
+	pattern.pattern = zend_str_tolower_dup(func, func_len);
+	pattern.cb = cb;
+	pattern.spec = spec;
+
+	zend_llist_add_element(&hp_globals.watch_patterns, &pattern);
+	hp_globals.resolved_stale = 1;
+}
+
+#define TW_WATCH_FILE_MAX_ANNOTATIONS 16
+
+/**
+ * Load span watch definitions from the file configured with
+ * tideways.span_watch_file into a persistent table. Called once in MINIT.
+ * Each non-empty line that does not start with '#' or ';' has the form:
+ *
+ *   Function\Name::method category [title=$0] [key=->property ...]
+ */
+static void hp_load_watch_file(const char *filename TSRMLS_DC)
+{
+	FILE *fp;
+	char line[1024];
+	char *func, *category, *token, *value, *last;
+	tw_watch_spec *spec;
+	smart_str dropped = {0};
+	int lineno = 0, c;
+
+	if (filename == NULL || filename[0] == '\0') {
+		return;
+	}
+
+	fp = VCWD_FOPEN(filename, "r");
+
+	if (fp == NULL) {
+		zend_error(E_CORE_WARNING, "tideways.span_watch_file: Cannot open '%s'", filename);
+		return;
+	}
+
+	tw_file_watch_specs = pemalloc(sizeof(HashTable), 1);
+	zend_hash_init(tw_file_watch_specs, 32, NULL, free_tw_watch_spec, 1);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+
+		/* a full buffer without newline is a longer line, its tail must not be read as a line of its own */
+		if (strlen(line) == sizeof(line) - 1 && line[sizeof(line) - 2] != '\n' && (c = fgetc(fp)) != EOF && c != '\n') {
+			zend_error(E_CORE_WARNING, "tideways.span_watch_file: Line longer than %d characters skipped in %s on line %d", (int)sizeof(line) - 1, filename, lineno);
+
+			while (c != EOF && c != '\n') {
+				c = fgetc(fp);
+			}
+
+			continue;
+		}
+
+		func = php_strtok_r(line, " \t\r\n", &last);
+
+		if (func == NULL || func[0] == '#' || func[0] == ';') {
+			continue;
+		}
+
+		category = php_strtok_r(NULL, " \t\r\n", &last);
+
+		if (category == NULL) {
+			zend_error(E_CORE_WARNING, "tideways.span_watch_file: Missing category in %s on line %d", filename, lineno);
+			continue;
+		}
+
+		spec = tw_watch_spec_alloc(category, strlen(category), TW_WATCH_FILE_MAX_ANNOTATIONS, 1);
+
+		while ((token = php_strtok_r(NULL, " \t\r\n", &last)) != NULL) {
+			value = strchr(token, '=');
+
+			if (value == NULL || value == token) {
+				zend_error(E_CORE_WARNING, "tideways.span_watch_file: Invalid extractor '%s' in %s on line %d", token, filename, lineno);
+				continue;
+			}
+
+			*value++ = '\0';
+
+			if (strcmp(token, "title") == 0) {
+				if (spec->title.property) {
+					pefree(spec->title.property, 1);
+				}
+
+				if (tw_watch_extractor_from_string(&spec->title, value, 1) == FAILURE) {
+					zend_error(E_CORE_WARNING, "tideways.span_watch_file: Invalid title '%s' in %s on line %d", value, filename, lineno);
+				}
+			} else if (spec->annotations_len < TW_WATCH_FILE_MAX_ANNOTATIONS) {
+				if (tw_watch_extractor_from_string(&spec->annotations[spec->annotations_len].extractor, value, 1) == FAILURE) {
+					zend_error(E_CORE_WARNING, "tideways.span_watch_file: Invalid annotation '%s' in %s on line %d", token, filename, lineno);
+					continue;
+				}
+
+				spec->annotations[spec->annotations_len].key = pestrdup(token, 1);
+				spec->annotations_len++;
+			} else {
+				if (dropped.len > 0) {
+					smart_str_appendl(&dropped, ", ", 2);
+				}
+
+				smart_str_appends(&dropped, token);
+			}
+		}
+
+		if (dropped.len > 0) {
+			smart_str_0(&dropped);
+			zend_error(E_CORE_WARNING, "tideways.span_watch_file: Only %d annotations per function, dropped %s of %s in %s on line %d",
+				TW_WATCH_FILE_MAX_ANNOTATIONS, dropped.c, func, filename, lineno);
+			dropped.len = 0;
+		}
+
+		zend_hash_update(tw_file_watch_specs, func, strlen(func)+1, &spec, sizeof(tw_watch_spec*), NULL);
+	}
+
+	smart_str_free(&dropped);
+	fclose(fp);
+}
+
+static void hp_free_watch_file(TSRMLS_D)
+{
+	if (tw_file_watch_specs) {
+		zend_hash_destroy(tw_file_watch_specs);
+		pefree(tw_file_watch_specs, 1);
+		tw_file_watch_specs = NULL;
+	}
+}
+
 PHP_FUNCTION(tideways_span_watch)
 {
 	char *func = NULL, *category = NULL;
-	int func_len, category_len;
+	int func_len;
+	zval *options = NULL;
+	tw_watch_spec *spec = NULL;
 	tw_trace_callback cb;
 
 	if (!hp_globals.enabled || (hp_globals.tideways_flags & TIDEWAYS_FLAGS_NO_SPANS) > 0) {
 		return;
 	}
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|s!", &func, &func_len, &category, &category_len) == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|z!", &func, &func_len, &options) == FAILURE) {
 		return;
 	}
 
-	if (category != NULL && strcmp(category, "view") == 0) {
-		cb = tw_trace_callback_view_engine;
-	} else if (category != NULL && strcmp(category, "event") == 0) {
-		cb = tw_trace_callback_event_dispatchers;
+	if (options != NULL && Z_TYPE_P(options) == IS_ARRAY) {
+		spec = tw_watch_spec_create(options TSRMLS_CC);
+		cb = NULL;
 	} else {
-		cb = tw_trace_callback_php_call;
+		if (options != NULL && Z_TYPE_P(options) == IS_STRING) {
+			category = Z_STRVAL_P(options);
+		}
+
+		if (category != NULL && strcmp(category, "view") == 0) {
+			cb = tw_trace_callback_view_engine;
+		} else if (category != NULL && strcmp(category, "event") == 0) {
+			cb = tw_trace_callback_event_dispatchers;
+		} else {
+			cb = tw_trace_callback_php_call;
+		}
 	}
 
-	register_trace_callback_len(func, func_len, cb);
+	if (strpbrk(func, "*?") != NULL) {
+		tideways_add_pattern_watch(func, func_len, cb, spec TSRMLS_CC);
+	} else if (spec != NULL) {
+		tideways_add_spec_watch(spec, func, func_len TSRMLS_CC);
+	} else {
+		register_trace_callback_len(func, func_len, cb);
+	}
 }
 
 static void free_tw_watch_callback(void *twcb)